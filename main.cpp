@@ -5,12 +5,39 @@
 #include <unordered_map>
 #include <fstream>
 #include <sstream>
+#include <iomanip>
+#include <random>
 #include <algorithm>
 #include <memory>
 #include <regex>
 #include <variant>
 #include <functional>
 #include <filesystem>
+#include <string_view>
+#include <cstdint>
+#include <cstring>
+#include <charconv>
+#include <cstdio>
+#include <cmath>
+#include <atomic>
+#include <stdexcept>
+#include <deque>
+#include <list>
+#include <queue>
+#include <thread>
+#include <shared_mutex>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define DB_X86_SIMD 1
+#include <immintrin.h>
+#endif
 
 // Forward declarations
 class Table;
@@ -25,6 +52,21 @@ enum class DataType {
     BOOLEAN
 };
 
+// Comparison operators usable in WHERE clauses
+enum class CompareOp {
+    EQ,
+    NE,
+    LT,
+    LE,
+    GT,
+    GE
+};
+
+static const char* compareOpSymbol(CompareOp op) {
+    static const char* const symbols[] = {"=", "<>", "<", "<=", ">", ">="};
+    return symbols[static_cast<int>(op)];
+}
+
 // Value wrapper for different data types
 class Value {
 public:
@@ -61,6 +103,11 @@ public:
     }
 };
 
+// A value as it would be written in a query, with text quoted
+static std::string formatLiteral(const Value& value) {
+    return value.type == DataType::TEXT ? "'" + value.toString() + "'" : value.toString();
+}
+
 // Column definition
 struct Column {
     std::string name;
@@ -98,8 +145,32 @@ private:
     std::map<Value, std::vector<size_t>> index;
     
 public:
+    // Row ids under a key stay in table order; appended rows go at the end
     void insert(const Value& key, size_t rowIndex) {
-        index[key].push_back(rowIndex);
+        auto& vec = index[key];
+        vec.insert(std::upper_bound(vec.begin(), vec.end(), rowIndex), rowIndex);
+    }
+
+    // Replaces the contents with the given (key, row id) entries. They are
+    // sorted in parallel and then appended in key order, which turns each
+    // map insertion into a constant-time append at the end of the tree.
+    void bulkLoad(std::vector<std::pair<Value, size_t>> entries, size_t parallelism);
+
+    // Drops the entries of the deleted row ids (ascending) and renumbers the
+    // others to where their rows are once the deleted ones are erased. Row
+    // ids under a key keep their order, so nothing needs sorting again.
+    void eraseRows(const std::vector<size_t>& deleted) {
+        for (auto it = index.begin(); it != index.end();) {
+            auto& vec = it->second;
+            size_t kept = 0;
+            for (size_t rowIndex : vec) {
+                auto below = std::lower_bound(deleted.begin(), deleted.end(), rowIndex);
+                if (below != deleted.end() && *below == rowIndex) continue;
+                vec[kept++] = rowIndex - (below - deleted.begin());
+            }
+            vec.resize(kept);
+            it = vec.empty() ? index.erase(it) : std::next(it);
+        }
     }
     
     void remove(const Value& key, size_t rowIndex) {
@@ -117,10 +188,502 @@ public:
         auto it = index.find(key);
         return it != index.end() ? it->second : std::vector<size_t>();
     }
+
+    // Returns the row ids stored under key without copying them, or nullptr
+    const std::vector<size_t>* lookup(const Value& key) const {
+        auto it = index.find(key);
+        return it != index.end() ? &it->second : nullptr;
+    }
     
     void clear() {
         index.clear();
     }
+
+    // Ordered access to keys, for range scans
+    typedef std::map<Value, std::vector<size_t>>::const_iterator Iterator;
+
+    Iterator begin() const {
+        return index.begin();
+    }
+
+    Iterator end() const {
+        return index.end();
+    }
+
+    Iterator lowerBound(const Value& key) const {
+        return index.lower_bound(key);
+    }
+
+    Iterator upperBound(const Value& key) const {
+        return index.upper_bound(key);
+    }
+};
+
+// Binary encoding of a single value: the type tag followed by the payload.
+// Shared by table files and temporary spill files.
+static void writeValue(std::ostream& file, const Value& val) {
+    file.write(reinterpret_cast<const char*>(&val.type), sizeof(val.type));
+    
+    switch (val.type) {
+        case DataType::INTEGER: {
+            int intVal = std::get<int>(val.data);
+            file.write(reinterpret_cast<const char*>(&intVal), sizeof(intVal));
+            break;
+        }
+        case DataType::TEXT: {
+            const std::string& strVal = std::get<std::string>(val.data);
+            size_t strLen = strVal.length();
+            file.write(reinterpret_cast<const char*>(&strLen), sizeof(strLen));
+            file.write(strVal.c_str(), strLen);
+            break;
+        }
+        case DataType::REAL: {
+            double realVal = std::get<double>(val.data);
+            file.write(reinterpret_cast<const char*>(&realVal), sizeof(realVal));
+            break;
+        }
+        case DataType::BOOLEAN: {
+            bool boolVal = std::get<bool>(val.data);
+            file.write(reinterpret_cast<const char*>(&boolVal), sizeof(boolVal));
+            break;
+        }
+    }
+}
+
+static Value readValue(std::istream& file) {
+    DataType type;
+    file.read(reinterpret_cast<char*>(&type), sizeof(type));
+    
+    switch (type) {
+        case DataType::INTEGER: {
+            int intVal;
+            file.read(reinterpret_cast<char*>(&intVal), sizeof(intVal));
+            return Value(intVal);
+        }
+        case DataType::TEXT: {
+            size_t strLen;
+            file.read(reinterpret_cast<char*>(&strLen), sizeof(strLen));
+            std::string strVal(strLen, '\0');
+            file.read(&strVal[0], strLen);
+            return Value(strVal);
+        }
+        case DataType::REAL: {
+            double realVal;
+            file.read(reinterpret_cast<char*>(&realVal), sizeof(realVal));
+            return Value(realVal);
+        }
+        case DataType::BOOLEAN: {
+            bool boolVal;
+            file.read(reinterpret_cast<char*>(&boolVal), sizeof(boolVal));
+            return Value(boolVal);
+        }
+    }
+    return Value(0);
+}
+
+// Total order used for sorting: values order by type first, then by value,
+// so rows holding values of mixed types still sort consistently. Returns
+// <0, 0 or >0.
+static int compareForSort(const Value& a, const Value& b) {
+    if (a.type != b.type) return a.type < b.type ? -1 : 1;
+    if (a.data < b.data) return -1;
+    return b.data < a.data ? 1 : 0;
+}
+
+// Hash for join and grouping keys and for distinct-value sketches. Values of
+// different types may collide but never compare equal, matching
+// Value::operator==.
+static uint64_t hashValue(const Value& value) {
+    uint64_t h = std::hash<std::variant<int, std::string, double, bool>>()(value.data);
+    // Finalizer from MurmurHash3, so the low bits used for bucket selection
+    // depend on every input bit
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Table statistics
+//
+// Per-column summaries the query planner uses to estimate how many rows a
+// condition selects, and from that the cost of each access path and join.
+// ANALYZE collects them (and the planner does on first use of a table):
+// row, empty-value and distinct counts and the value range come from every
+// row, the most common values and an equi-depth histogram of the remaining
+// values from a random sample. Histogram bounds are spaced so that
+// each bucket holds about the same number of rows, which keeps range
+// estimates useful on skewed data. Inserts and deletes update the counts
+// and distinct-value sketches in place until enough of the table has
+// changed to collect them again.
+
+// Reading a row through an index costs about as much as scanning this many
+// rows in table order
+static constexpr double INDEX_ROW_COST = 4.0;
+
+// HyperLogLog sketch estimating the number of distinct values added to it
+// in fixed memory, within about 1.6%. Each value's hash picks a register by
+// its top bits, and the register keeps the longest run of leading zeros seen
+// in the remaining bits. Sketches of disjoint parts of a table merge into
+// the sketch of the whole.
+class HyperLogLog {
+public:
+    static constexpr int PRECISION = 12;
+    static constexpr size_t REGISTERS = size_t(1) << PRECISION;
+
+private:
+    std::vector<uint8_t> registers;
+    // How many registers hold each rank, so estimates take O(ranks)
+    std::vector<uint32_t> rankCounts;
+
+public:
+    HyperLogLog() : registers(REGISTERS, 0), rankCounts(66, 0) {
+        rankCounts[0] = REGISTERS;
+    }
+
+    void add(uint64_t hash) {
+        size_t index = hash >> (64 - PRECISION);
+        uint64_t rest = hash << PRECISION;
+        uint8_t rank = 1;
+        while (rank <= 64 - PRECISION && !(rest & (1ULL << 63))) {
+            rank++;
+            rest <<= 1;
+        }
+        setRegister(index, rank);
+    }
+
+    void merge(const HyperLogLog& other) {
+        for (size_t i = 0; i < REGISTERS; i++) {
+            setRegister(i, other.registers[i]);
+        }
+    }
+
+    double estimate() const {
+        double inverseSum = 0;
+        for (size_t rank = 0; rank < rankCounts.size(); rank++) {
+            inverseSum += std::ldexp(static_cast<double>(rankCounts[rank]), -static_cast<int>(rank));
+        }
+        double m = REGISTERS;
+        double raw = 0.7213 / (1 + 1.079 / m) * m * m / inverseSum;
+        // Small cardinalities leave registers empty; linear counting is
+        // more accurate there
+        if (raw <= 2.5 * m && rankCounts[0] > 0) {
+            return m * std::log(m / rankCounts[0]);
+        }
+        return raw;
+    }
+
+    void write(std::ostream& file) const {
+        file.write(reinterpret_cast<const char*>(registers.data()), REGISTERS);
+    }
+
+    bool read(std::istream& file) {
+        std::vector<uint8_t> loaded(REGISTERS);
+        if (!file.read(reinterpret_cast<char*>(loaded.data()), REGISTERS)) return false;
+        for (size_t i = 0; i < REGISTERS; i++) {
+            if (loaded[i] >= rankCounts.size()) return false;
+            setRegister(i, loaded[i]);
+        }
+        return true;
+    }
+
+private:
+    void setRegister(size_t index, uint8_t rank) {
+        if (rank <= registers[index]) return;
+        rankCounts[registers[index]]--;
+        rankCounts[rank]++;
+        registers[index] = rank;
+    }
+};
+
+struct ColumnStatistics {
+    HyperLogLog sketch;       // all non-empty values
+    double distinctCount = 0; // estimate from sketch
+    size_t emptyCount = 0;    // empty values, which NOT NULL rejects
+    bool hasRange = false;    // false while the column has no non-empty values
+    Value min{0};
+    Value max{0};
+    // Most common non-empty values with the fraction of rows holding each
+    std::vector<std::pair<Value, double>> mostCommon;
+    // Ascending bucket bounds in compareForSort order over the non-empty
+    // values that are not among the most common; bucket i holds the values
+    // between bounds i and i + 1
+    std::vector<Value> histogram;
+};
+
+struct TableStatistics {
+    static constexpr size_t HISTOGRAM_BUCKETS = 32;
+    static constexpr size_t MOST_COMMON_VALUES = 8;
+    // Rows sampled for the most common values and histograms
+    static constexpr size_t SAMPLE_ROWS = 30000;
+    // Rows each collection task reads at a time
+    static constexpr size_t COLLECT_CHUNK = 16384;
+
+    size_t rowCount = 0;
+    std::vector<ColumnStatistics> columns;
+
+    // Reads the rows on up to parallelism pool tasks. The rows must not
+    // change meanwhile (a shared table lock is enough).
+    static TableStatistics collect(const std::vector<Row>& rows, size_t columnCount, size_t parallelism);
+
+    static bool isEmptyValue(const Value& value) {
+        return value.type == DataType::TEXT && std::get<std::string>(value.data).empty();
+    }
+
+    // Folds an inserted row into the statistics
+    void addRow(const Row& row) {
+        rowCount++;
+        addValues(columns, row);
+        for (auto& column : columns) {
+            column.distinctCount = std::min(column.sketch.estimate(),
+                                            static_cast<double>(rowCount - column.emptyCount));
+        }
+    }
+
+    // Folds a deleted row into the statistics. Sketches and ranges cannot
+    // forget values, so they keep describing the deleted rows until the
+    // statistics are collected again.
+    void removeRow(const Row& row) {
+        if (rowCount == 0) return;
+        rowCount--;
+        for (size_t col = 0; col < columns.size(); col++) {
+            if (isEmptyValue(row[col]) && columns[col].emptyCount > 0) columns[col].emptyCount--;
+            columns[col].distinctCount = std::min(columns[col].distinctCount,
+                                                  static_cast<double>(rowCount - columns[col].emptyCount));
+        }
+    }
+
+    double nullFraction(size_t column) const {
+        return rowCount ? static_cast<double>(columns[column].emptyCount) / rowCount : 0;
+    }
+
+    // Estimated fraction of rows whose value in column equals value
+    double equalFraction(size_t column, const Value& value) const {
+        const ColumnStatistics& c = columns[column];
+        if (isEmptyValue(value)) return nullFraction(column);
+        if (!c.hasRange || compareForSort(value, c.min) < 0 || compareForSort(value, c.max) > 0) {
+            return 0;
+        }
+        for (const auto& common : c.mostCommon) {
+            if (compareForSort(common.first, value) == 0) return common.second;
+        }
+        double others = std::max(c.distinctCount - c.mostCommon.size(), 1.0);
+        return otherFraction(column) / others;
+    }
+
+    // Estimated fraction of rows whose value in column lies between the
+    // bounds; a null bound leaves that side open
+    double rangeFraction(size_t column, const Value* lower, bool lowerInclusive, const Value* upper,
+                         bool upperInclusive) const {
+        double below = lower ? belowFraction(column, *lower, !lowerInclusive) : 0;
+        double atOrBelow = upper ? belowFraction(column, *upper, upperInclusive) : 1;
+        return std::min(std::max(atOrBelow - below, 0.0), 1.0);
+    }
+
+    // Binary encoding, stored next to the table file
+    void write(std::ostream& file) const {
+        size_t columnCount = columns.size();
+        file.write(reinterpret_cast<const char*>(&rowCount), sizeof(rowCount));
+        file.write(reinterpret_cast<const char*>(&columnCount), sizeof(columnCount));
+        for (const auto& column : columns) {
+            column.sketch.write(file);
+            file.write(reinterpret_cast<const char*>(&column.emptyCount), sizeof(column.emptyCount));
+            file.write(reinterpret_cast<const char*>(&column.hasRange), sizeof(column.hasRange));
+            if (column.hasRange) {
+                writeValue(file, column.min);
+                writeValue(file, column.max);
+            }
+            size_t commonCount = column.mostCommon.size();
+            file.write(reinterpret_cast<const char*>(&commonCount), sizeof(commonCount));
+            for (const auto& common : column.mostCommon) {
+                writeValue(file, common.first);
+                file.write(reinterpret_cast<const char*>(&common.second), sizeof(common.second));
+            }
+            size_t boundCount = column.histogram.size();
+            file.write(reinterpret_cast<const char*>(&boundCount), sizeof(boundCount));
+            for (const auto& bound : column.histogram) {
+                writeValue(file, bound);
+            }
+        }
+    }
+
+    static bool read(std::istream& file, size_t expectedColumns, TableStatistics& stats) {
+        size_t columnCount = 0;
+        file.read(reinterpret_cast<char*>(&stats.rowCount), sizeof(stats.rowCount));
+        file.read(reinterpret_cast<char*>(&columnCount), sizeof(columnCount));
+        if (!file || columnCount != expectedColumns) return false;
+
+        stats.columns.assign(columnCount, ColumnStatistics());
+        for (auto& column : stats.columns) {
+            if (!column.sketch.read(file)) return false;
+            file.read(reinterpret_cast<char*>(&column.emptyCount), sizeof(column.emptyCount));
+            file.read(reinterpret_cast<char*>(&column.hasRange), sizeof(column.hasRange));
+            if (column.hasRange) {
+                column.min = readValue(file);
+                column.max = readValue(file);
+            }
+            size_t commonCount = 0;
+            file.read(reinterpret_cast<char*>(&commonCount), sizeof(commonCount));
+            if (!file || commonCount > MOST_COMMON_VALUES) return false;
+            for (size_t i = 0; i < commonCount; i++) {
+                Value value = readValue(file);
+                double fraction = 0;
+                file.read(reinterpret_cast<char*>(&fraction), sizeof(fraction));
+                column.mostCommon.push_back({value, fraction});
+            }
+            size_t boundCount = 0;
+            file.read(reinterpret_cast<char*>(&boundCount), sizeof(boundCount));
+            if (!file || boundCount > HISTOGRAM_BUCKETS + 1) return false;
+            for (size_t i = 0; i < boundCount; i++) {
+                column.histogram.push_back(readValue(file));
+            }
+            column.distinctCount = std::min(column.sketch.estimate(),
+                                            static_cast<double>(stats.rowCount - std::min(column.emptyCount, stats.rowCount)));
+        }
+        return static_cast<bool>(file);
+    }
+
+private:
+    static void extendRange(ColumnStatistics& column, const Value& value) {
+        if (!column.hasRange || compareForSort(value, column.min) < 0) column.min = value;
+        if (!column.hasRange || compareForSort(value, column.max) > 0) column.max = value;
+        column.hasRange = true;
+    }
+
+    static void addValues(std::vector<ColumnStatistics>& columns, const Row& row) {
+        for (size_t col = 0; col < columns.size(); col++) {
+            const Value& value = row[col];
+            if (isEmptyValue(value)) {
+                columns[col].emptyCount++;
+            } else {
+                columns[col].sketch.add(hashValue(value));
+                extendRange(columns[col], value);
+            }
+        }
+    }
+
+    // Picks the most common values of a sorted sample of a column's
+    // non-empty values and builds the histogram from the rest. A value is
+    // common if it occurs at least twice and, unless the sample has no more
+    // distinct values than fit in the list, a quarter more often than the
+    // average value. sampleSize counts empty values too, so fractions are
+    // of all rows.
+    static void summarizeSample(ColumnStatistics& column, const std::vector<const Value*>& sample,
+                                size_t sampleSize) {
+        std::vector<std::pair<size_t, size_t>> runs; // (start, length) of equal values
+        for (size_t i = 0; i < sample.size(); i++) {
+            if (i == 0 || compareForSort(*sample[i - 1], *sample[i]) != 0) {
+                runs.push_back({i, 0});
+            }
+            runs.back().second++;
+        }
+
+        double threshold = runs.size() <= MOST_COMMON_VALUES
+                               ? 2.0
+                               : std::max(1.25 * sample.size() / runs.size(), 2.0);
+        std::vector<std::pair<size_t, size_t>> common;
+        for (const auto& run : runs) {
+            if (run.second >= threshold) common.push_back(run);
+        }
+        std::stable_sort(common.begin(), common.end(), [](const std::pair<size_t, size_t>& a,
+                                                          const std::pair<size_t, size_t>& b) {
+            return a.second > b.second;
+        });
+        if (common.size() > MOST_COMMON_VALUES) common.resize(MOST_COMMON_VALUES);
+
+        std::vector<bool> isCommon(sample.size(), false);
+        for (const auto& run : common) {
+            column.mostCommon.push_back({*sample[run.first], static_cast<double>(run.second) / sampleSize});
+            std::fill(isCommon.begin() + run.first, isCommon.begin() + run.first + run.second, true);
+        }
+
+        std::vector<const Value*> rest;
+        for (size_t i = 0; i < sample.size(); i++) {
+            if (!isCommon[i]) rest.push_back(sample[i]);
+        }
+        if (rest.empty()) return;
+        for (size_t b = 0; b <= HISTOGRAM_BUCKETS; b++) {
+            column.histogram.push_back(*rest[b * (rest.size() - 1) / HISTOGRAM_BUCKETS]);
+        }
+    }
+
+    // Fraction of rows holding non-empty values outside the most common ones
+    double otherFraction(size_t column) const {
+        double fraction = 1 - nullFraction(column);
+        for (const auto& common : columns[column].mostCommon) {
+            fraction -= common.second;
+        }
+        return std::max(fraction, 0.0);
+    }
+
+    static bool numericValue(const Value& value, double& number) {
+        if (value.type == DataType::INTEGER) number = std::get<int>(value.data);
+        else if (value.type == DataType::REAL) number = std::get<double>(value.data);
+        else return false;
+        return true;
+    }
+
+    // Fraction of rows with a value below value (or equal to it, when
+    // inclusive). Empty values and the most common values are counted
+    // exactly; within a histogram bucket, numeric values are interpolated
+    // linearly between its bounds and other types count as half the bucket.
+    double belowFraction(size_t column, const Value& value, bool inclusive) const {
+        const ColumnStatistics& c = columns[column];
+        double fraction = 0;
+
+        int order = compareForSort(Value(std::string()), value);
+        if (order < 0 || (order == 0 && inclusive)) {
+            fraction += nullFraction(column);
+        }
+        bool common = false;
+        for (const auto& entry : c.mostCommon) {
+            order = compareForSort(entry.first, value);
+            common = common || order == 0;
+            if (order < 0 || (order == 0 && inclusive)) fraction += entry.second;
+        }
+
+        const std::vector<Value>& bounds = c.histogram;
+        if (!bounds.empty()) {
+            auto less = [](const Value& a, const Value& b) { return compareForSort(a, b) < 0; };
+            size_t k = std::lower_bound(bounds.begin(), bounds.end(), value, less) - bounds.begin();
+            double histogramFraction = 1;
+            if (k == 0) {
+                histogramFraction = 0;
+            } else if (k < bounds.size()) {
+                double from, to, at;
+                double within = 0.5;
+                if (numericValue(bounds[k - 1], from) && numericValue(bounds[k], to) &&
+                    numericValue(value, at) && to > from) {
+                    within = (at - from) / (to - from);
+                }
+                histogramFraction = (k - 1 + within) / HISTOGRAM_BUCKETS;
+            }
+            fraction += otherFraction(column) * histogramFraction;
+        }
+
+        if (inclusive && !common && !isEmptyValue(value)) {
+            fraction += equalFraction(column, value);
+        }
+        return std::min(fraction, 1.0);
+    }
+};
+
+// Versions identify the contents of a table: every change to a table gives
+// it a new one, drawn from a process-wide counter so that a table that is
+// dropped and created again never repeats the version of its predecessor
+static uint64_t nextTableVersion() {
+    static std::atomic<uint64_t> counter{0};
+    return ++counter;
+}
+
+// Told about every row a table inserts or deletes, while the table is
+// locked exclusively; materialized views use this to follow their source
+class TableListener {
+public:
+    virtual ~TableListener() = default;
+    virtual void rowInserted(const Row& row) = 0;
+    virtual void rowDeleted(const Row& row) = 0;
 };
 
 // Table class
@@ -132,10 +695,44 @@ private:
     std::unordered_map<std::string, size_t> columnMap;
     std::unordered_map<std::string, std::unique_ptr<BTreeIndex>> indexes;
     size_t nextAutoIncrement = 1;
+    // Shared by readers holding row references (result cursors), held
+    // exclusively by statements that modify the table
+    mutable std::shared_mutex lock;
+    // Planner statistics. Inserts and deletes update them in place, under
+    // the exclusive table lock; modifications counts those changes, and
+    // statisticsModifications how many of them had happened when the
+    // statistics were last collected.
+    mutable std::shared_ptr<TableStatistics> statistics;
+    size_t modifications = 0;
+    mutable size_t statisticsModifications = 0;
+    mutable std::mutex statisticsMutex;
+    // Changed under the exclusive table lock, whenever rows change
+    std::atomic<uint64_t> version{nextTableVersion()};
+    std::vector<TableListener*> listeners;
+
+    std::shared_ptr<const TableStatistics> collectStatistics() const;
 
 public:
     Table(const std::string& tableName) : name(tableName) {}
 
+    // Integers given for REAL columns are stored as REAL. Comparisons and
+    // aggregates are typed, so a column must hold one numeric type for
+    // "v = 5" or SUM(v) to see all of its values.
+    static Value toColumnType(Value value, DataType type) {
+        if (type == DataType::REAL && value.type == DataType::INTEGER) {
+            return Value(static_cast<double>(std::get<int>(value.data)));
+        }
+        return value;
+    }
+
+    std::shared_mutex& getLock() const {
+        return lock;
+    }
+
+    uint64_t getVersion() const {
+        return version.load();
+    }
+
     void addColumn(const Column& column) {
         columnMap[column.name] = columns.size();
         columns.push_back(column);
@@ -164,6 +761,7 @@ public:
             if (columns[i].autoIncrement) {
                 rowValues[i] = Value(static_cast<int>(nextAutoIncrement++));
             }
+            rowValues[i] = toColumnType(std::move(rowValues[i]), columns[i].type);
         }
 
         // Update indexes
@@ -174,66 +772,100 @@ public:
         }
 
         rows.emplace_back(rowValues);
+        modifications++;
+        if (statistics) statistics->addRow(rows.back());
+        for (auto* listener : listeners) listener->rowInserted(rows.back());
+        version = nextTableVersion();
         return true;
     }
 
-    std::vector<Row> selectAll() const {
-        return rows;
+    // Replaces the values of the row at index in place, without constraint
+    // checks. Only the indexes on columns whose value changed are updated.
+    void updateRow(size_t index, std::vector<Value> values) {
+        Row& row = rows[index];
+        for (auto& pair : indexes) {
+            size_t colIndex = columnMap[pair.first];
+            if (!(row[colIndex] == values[colIndex])) {
+                pair.second->remove(row[colIndex], index);
+                pair.second->insert(values[colIndex], index);
+            }
+        }
+        if (statistics) statistics->removeRow(row);
+        for (auto* listener : listeners) listener->rowDeleted(row);
+        row.values = std::move(values);
+        if (statistics) statistics->addRow(row);
+        for (auto* listener : listeners) listener->rowInserted(row);
+        modifications++;
+        version = nextTableVersion();
     }
 
-    std::vector<Row> selectWhere(const std::string& columnName, const Value& value) const {
-        std::vector<Row> result;
-        
-        // Use index if available
-        if (indexes.find(columnName) != indexes.end()) {
-            auto rowIndexes = indexes.at(columnName)->find(value);
-            for (size_t idx : rowIndexes) {
-                if (idx < rows.size()) {
-                    result.push_back(rows[idx]);
-                }
-            }
-        } else {
-            // Linear search
-            auto colIt = columnMap.find(columnName);
-            if (colIt != columnMap.end()) {
-                size_t colIndex = colIt->second;
-                for (const auto& row : rows) {
-                    if (row[colIndex] == value) {
-                        result.push_back(row);
-                    }
-                }
+    // Removes the row at index by moving the last row into its place, so
+    // that only those two rows' index entries change. Unlike deleteRows,
+    // this does not keep the order of the rows.
+    void removeRowAt(size_t index) {
+        size_t last = rows.size() - 1;
+        for (auto& pair : indexes) {
+            size_t colIndex = columnMap[pair.first];
+            pair.second->remove(rows[index][colIndex], index);
+            if (index != last) {
+                pair.second->remove(rows[last][colIndex], last);
+                pair.second->insert(rows[last][colIndex], index);
             }
         }
-        
-        return result;
+        if (statistics) statistics->removeRow(rows[index]);
+        for (auto* listener : listeners) listener->rowDeleted(rows[index]);
+        if (index != last) rows[index] = std::move(rows[last]);
+        rows.pop_back();
+        modifications++;
+        version = nextTableVersion();
     }
 
-    bool deleteWhere(const std::string& columnName, const Value& value) {
-        auto colIt = columnMap.find(columnName);
-        if (colIt == columnMap.end()) return false;
-        
-        size_t colIndex = colIt->second;
-        bool deleted = false;
-        
-        for (auto it = rows.begin(); it != rows.end();) {
-            if ((*it)[colIndex] == value) {
-                // Update indexes
-                for (size_t i = 0; i < columns.size(); i++) {
-                    if (indexes.find(columns[i].name) != indexes.end()) {
-                        size_t rowIdx = std::distance(rows.begin(), it);
-                        indexes[columns[i].name]->remove((*it)[i], rowIdx);
-                    }
+    // Listeners are added and removed under the exclusive table lock
+    void addListener(TableListener* listener) {
+        listeners.push_back(listener);
+    }
+
+    void removeListener(TableListener* listener) {
+        listeners.erase(std::remove(listeners.begin(), listeners.end(), listener), listeners.end());
+    }
+
+    // Deletes the rows at the given positions (ascending, as findRows
+    // returns them), keeping the others in order. Rows deleted from the end
+    // only lose their own index entries; otherwise the entries of the rows
+    // that move up are renumbered in place.
+    void deleteRows(const std::vector<size_t>& positions) {
+        if (positions.empty()) return;
+
+        bool atEnd = positions.front() == rows.size() - positions.size();
+        for (auto& pair : indexes) {
+            if (atEnd) {
+                size_t colIndex = columnMap[pair.first];
+                for (size_t position : positions) {
+                    pair.second->remove(rows[position][colIndex], position);
                 }
-                it = rows.erase(it);
-                deleted = true;
             } else {
-                ++it;
+                pair.second->eraseRows(positions);
             }
         }
-        
-        return deleted;
+
+        size_t kept = positions.front();
+        size_t next = 0;
+        for (size_t i = positions.front(); i < rows.size(); i++) {
+            if (next < positions.size() && positions[next] == i) {
+                if (statistics) statistics->removeRow(rows[i]);
+                for (auto* listener : listeners) listener->rowDeleted(rows[i]);
+                next++;
+            } else {
+                rows[kept++] = std::move(rows[i]);
+            }
+        }
+        rows.erase(rows.begin() + kept, rows.end());
+        modifications += positions.size();
+        version = nextTableVersion();
     }
 
+    void rebuildIndexes();
+
     const std::vector<Column>& getColumns() const {
         return columns;
     }
@@ -246,6 +878,62 @@ public:
         return rows.size();
     }
 
+    const Row& getRow(size_t index) const {
+        return rows[index];
+    }
+
+    // Returns the position of a column, or -1 if the table has no such column
+    int getColumnIndex(const std::string& columnName) const {
+        auto it = columnMap.find(columnName);
+        return it != columnMap.end() ? static_cast<int>(it->second) : -1;
+    }
+
+    const BTreeIndex* getIndex(const std::string& columnName) const {
+        auto it = indexes.find(columnName);
+        return it != indexes.end() ? it->second.get() : nullptr;
+    }
+
+    // Column statistics for the planner, or null if ANALYZE has not
+    // collected them or more than a tenth of the rows they describe have
+    // changed since. Never reads the table. Callers must hold the table
+    // lock (shared is enough) while they use them.
+    std::shared_ptr<const TableStatistics> getStatistics() const {
+        std::lock_guard<std::mutex> guard(statisticsMutex);
+        bool stale = !statistics || (modifications - statisticsModifications) * 10 > statistics->rowCount;
+        return stale ? nullptr : statistics;
+    }
+
+    // Collects the statistics now (ANALYZE). Only a shared table lock is
+    // needed, so readers are not held up while the table is read.
+    std::shared_ptr<const TableStatistics> analyze() const {
+        return collectStatistics();
+    }
+
+    bool saveStatistics(const std::string& filename) const {
+        std::lock_guard<std::mutex> guard(statisticsMutex);
+        if (!statistics) return true;
+        std::ofstream file(filename, std::ios::binary);
+        if (!file.is_open()) return false;
+        statistics->write(file);
+        return static_cast<bool>(file);
+    }
+
+    // Loads statistics saved next to the table file. Rows added or removed
+    // since they were saved count as changes towards collecting them again.
+    bool loadStatistics(const std::string& filename) {
+        std::ifstream file(filename, std::ios::binary);
+        if (!file.is_open()) return false;
+        auto loaded = std::make_shared<TableStatistics>();
+        if (!TableStatistics::read(file, columns.size(), *loaded)) return false;
+
+        size_t drift = loaded->rowCount > rows.size() ? loaded->rowCount - rows.size() : rows.size() - loaded->rowCount;
+        std::lock_guard<std::mutex> guard(statisticsMutex);
+        statistics = loaded;
+        statisticsModifications = modifications;
+        modifications += drift;
+        return true;
+    }
+
     // Persistence methods
     bool saveToFile(const std::string& filename) const {
         std::ofstream file(filename, std::ios::binary);
@@ -276,33 +964,7 @@ public:
         
         for (const auto& row : rows) {
             for (size_t i = 0; i < row.size(); i++) {
-                const Value& val = row[i];
-                file.write(reinterpret_cast<const char*>(&val.type), sizeof(val.type));
-                
-                switch (val.type) {
-                    case DataType::INTEGER: {
-                        int intVal = std::get<int>(val.data);
-                        file.write(reinterpret_cast<const char*>(&intVal), sizeof(intVal));
-                        break;
-                    }
-                    case DataType::TEXT: {
-                        std::string strVal = std::get<std::string>(val.data);
-                        size_t strLen = strVal.length();
-                        file.write(reinterpret_cast<const char*>(&strLen), sizeof(strLen));
-                        file.write(strVal.c_str(), strLen);
-                        break;
-                    }
-                    case DataType::REAL: {
-                        double realVal = std::get<double>(val.data);
-                        file.write(reinterpret_cast<const char*>(&realVal), sizeof(realVal));
-                        break;
-                    }
-                    case DataType::BOOLEAN: {
-                        bool boolVal = std::get<bool>(val.data);
-                        file.write(reinterpret_cast<const char*>(&boolVal), sizeof(boolVal));
-                        break;
-                    }
-                }
+                writeValue(file, row[i]);
             }
         }
 
@@ -318,6 +980,7 @@ public:
         rows.clear();
         columnMap.clear();
         indexes.clear();
+        statistics.reset();
 
         // Read table name
         size_t nameLen;
@@ -357,42 +1020,14 @@ public:
             std::vector<Value> values;
             
             for (size_t j = 0; j < columns.size(); j++) {
-                DataType type;
-                file.read(reinterpret_cast<char*>(&type), sizeof(type));
-                
-                switch (type) {
-                    case DataType::INTEGER: {
-                        int intVal;
-                        file.read(reinterpret_cast<char*>(&intVal), sizeof(intVal));
-                        values.emplace_back(intVal);
-                        break;
-                    }
-                    case DataType::TEXT: {
-                        size_t strLen;
-                        file.read(reinterpret_cast<char*>(&strLen), sizeof(strLen));
-                        std::string strVal(strLen, '\0');
-                        file.read(&strVal[0], strLen);
-                        values.emplace_back(strVal);
-                        break;
-                    }
-                    case DataType::REAL: {
-                        double realVal;
-                        file.read(reinterpret_cast<char*>(&realVal), sizeof(realVal));
-                        values.emplace_back(realVal);
-                        break;
-                    }
-                    case DataType::BOOLEAN: {
-                        bool boolVal;
-                        file.read(reinterpret_cast<char*>(&boolVal), sizeof(boolVal));
-                        values.emplace_back(boolVal);
-                        break;
-                    }
-                }
+                values.push_back(toColumnType(readValue(file), columns[j].type));
             }
             
             rows.emplace_back(values);
         }
 
+        version = nextTableVersion();
+        rebuildIndexes();
         return true;
     }
 };
@@ -400,8 +1035,20 @@ public:
 // Database class
 class Database {
 private:
+    // A materialized view's rows are kept in the table of the same name,
+    // which its maintainer updates as rows of the source table change
+    struct View {
+        std::string source;
+        std::string definition; // the view's SELECT
+        std::unique_ptr<TableListener> maintainer;
+    };
+
     std::string dbName;
     std::unordered_map<std::string, std::unique_ptr<Table>> tables;
+    std::unordered_map<std::string, View> views;
+    // View definitions read by loadFromFile, to be created once their
+    // source tables are loaded
+    std::vector<std::pair<std::string, std::string>> savedViews;
     std::string dataDir;
 
 public:
@@ -424,6 +1071,10 @@ public:
         return true;
     }
 
+    const std::string& getDataDir() const {
+        return dataDir;
+    }
+
     Table* getTable(const std::string& tableName) {
         auto it = tables.find(tableName);
         return it != tables.end() ? it->second.get() : nullptr;
@@ -432,9 +1083,22 @@ public:
     bool dropTable(const std::string& tableName) {
         auto it = tables.find(tableName);
         if (it != tables.end()) {
+            // Views over the table go with it
+            for (const auto& viewName : getViews(tableName)) {
+                dropTable(viewName);
+            }
+            auto view = views.find(tableName);
+            if (view != views.end()) {
+                Table* source = getTable(view->second.source);
+                if (source) source->removeListener(view->second.maintainer.get());
+                views.erase(view);
+                std::filesystem::remove(dataDir + "/" + tableName + ".view");
+            }
+
             // Remove file
             std::string filename = dataDir + "/" + tableName + ".tbl";
             std::filesystem::remove(filename);
+            std::filesystem::remove(dataDir + "/" + tableName + ".stats");
             
             tables.erase(it);
             return true;
@@ -442,6 +1106,34 @@ public:
         return false;
     }
 
+    // Registers a materialized view whose table has already been created
+    // and filled; from now on its maintainer follows the source table
+    void addView(const std::string& viewName, const std::string& sourceName, const std::string& definition,
+                 std::unique_ptr<TableListener> maintainer) {
+        getTable(sourceName)->addListener(maintainer.get());
+        views[viewName] = View{sourceName, definition, std::move(maintainer)};
+    }
+
+    bool isView(const std::string& name) const {
+        return views.find(name) != views.end();
+    }
+
+    // Names of the views maintained from a table
+    std::vector<std::string> getViews(const std::string& sourceName) const {
+        std::vector<std::string> names;
+        for (const auto& pair : views) {
+            if (pair.second.source == sourceName) names.push_back(pair.first);
+        }
+        return names;
+    }
+
+    // (name, SELECT) of the views found by the last loadFromFile
+    std::vector<std::pair<std::string, std::string>> takeSavedViews() {
+        auto found = std::move(savedViews);
+        savedViews.clear();
+        return found;
+    }
+
     std::vector<std::string> listTables() const {
         std::vector<std::string> tableNames;
         for (const auto& pair : tables) {
@@ -450,16 +1142,30 @@ public:
         return tableNames;
     }
 
+    // Views are saved as their definitions and computed again when loaded
     bool saveToFile() {
+        for (const auto& pair : views) {
+            std::ofstream file(dataDir + "/" + pair.first + ".view");
+            if (!(file << pair.second.definition)) {
+                return false;
+            }
+        }
         for (const auto& pair : tables) {
+            if (isView(pair.first)) continue;
             std::string filename = dataDir + "/" + pair.first + ".tbl";
-            if (!pair.second->saveToFile(filename)) {
+            if (!pair.second->saveToFile(filename) || !saveStatistics(pair.first)) {
                 return false;
             }
         }
         return true;
     }
 
+    // Writes a table's statistics to <table>.stats next to its table file
+    bool saveStatistics(const std::string& tableName) const {
+        auto it = tables.find(tableName);
+        return it != tables.end() && it->second->saveStatistics(dataDir + "/" + tableName + ".stats");
+    }
+
     bool loadFromFile() {
         try {
             for (const auto& entry : std::filesystem::directory_iterator(dataDir)) {
@@ -468,8 +1174,13 @@ public:
                     auto table = std::make_unique<Table>(tableName);
                     
                     if (table->loadFromFile(entry.path().string())) {
+                        table->loadStatistics(dataDir + "/" + tableName + ".stats");
                         tables[tableName] = std::move(table);
                     }
+                } else if (entry.path().extension() == ".view") {
+                    std::ifstream file(entry.path());
+                    std::string definition((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+                    savedViews.emplace_back(entry.path().stem().string(), definition);
                 }
             }
             return true;
@@ -479,234 +1190,5771 @@ public:
     }
 };
 
-// SQL Query Parser
-class QueryParser {
-private:
-    std::string query;
-    std::vector<std::string> tokens;
-    size_t currentToken = 0;
+// Query execution operators (pull-based iterator model)
+//
+// Every operator follows the open/next/close protocol. next() hands out a
+// pointer to the current row, which either points straight into table
+// storage or into a buffer owned by the operator; it stays valid until the
+// following call to next(). Rows therefore stream through a plan without
+// being copied into intermediate result vectors.
+class Operator {
+public:
+    virtual ~Operator() = default;
 
-    void tokenize() {
-        tokens.clear();
-        std::regex tokenRegex(R"([a-zA-Z_][a-zA-Z0-9_]*|'[^']*'|"[^"]*"|\d+\.?\d*|[(),;=<>!]+|[+\-*/])");
-        std::sregex_iterator iter(query.begin(), query.end(), tokenRegex);
-        std::sregex_iterator end;
+    virtual void open() = 0;
+    virtual bool next(const Row*& row) = 0;
+    virtual void close() = 0;
 
-        for (; iter != end; ++iter) {
-            tokens.push_back(iter->str());
-        }
+    // Columns of the rows produced by next()
+    virtual const std::vector<Column>& getSchema() const = 0;
+
+    // True if the rows handed out by next() point into table storage and so
+    // stay valid after later next() calls
+    virtual bool producesStableRows() const {
+        return false;
     }
 
-    std::string getCurrentToken() const {
-        return currentToken < tokens.size() ? tokens[currentToken] : "";
+    // One line describing the operator for EXPLAIN, without its inputs
+    virtual std::string describe() const = 0;
+
+    // The operator's input plans. EXPLAIN walks them, and EXPLAIN ANALYZE
+    // replaces each with a measuring wrapper.
+    virtual std::vector<std::unique_ptr<Operator>*> inputs() {
+        return {};
     }
 
-    void consumeToken() {
-        if (currentToken < tokens.size()) {
-            currentToken++;
+    // The "table.column" index this operator reads through, if any
+    virtual std::string indexUsed() const {
+        return "";
+    }
+
+    // Rows the planner expects next() to produce, or -1 if it did not say
+    double estimatedRows = -1;
+};
+
+// The operator and its inputs on one line, for plans built inside operators
+static std::string describePlan(Operator& op) {
+    std::string text = op.describe();
+    auto inputs = op.inputs();
+    for (size_t i = 0; i < inputs.size(); i++) {
+        text += (i == 0 ? " <- " : ", ") + describePlan(**inputs[i]);
+    }
+    return text;
+}
+
+// Name of an index as "table.column"
+static std::string indexName(const Table& table, const BTreeIndex& index) {
+    for (const auto& column : table.getColumns()) {
+        if (table.getIndex(column.name) == &index) return table.getName() + "." + column.name;
+    }
+    return table.getName();
+}
+
+// Full scan over a table in insertion order, or over the rows [first, last)
+class TableScanOperator : public Operator {
+private:
+    const Table& table;
+    size_t first;
+    size_t last;
+    size_t position = 0;
+
+public:
+    TableScanOperator(const Table& t, size_t firstRow = 0, size_t lastRow = SIZE_MAX)
+        : table(t), first(firstRow), last(lastRow) {}
+
+    void open() override {
+        position = first;
+    }
+
+    bool next(const Row*& row) override {
+        if (position >= std::min(last, table.getRowCount())) return false;
+        row = &table.getRow(position++);
+        return true;
+    }
+
+    void close() override {}
+
+    std::string describe() const override {
+        std::string text = "TableScan " + table.getName();
+        if (first > 0 || last != SIZE_MAX) {
+            text += " rows [" + std::to_string(first) + ", " +
+                    (last == SIZE_MAX ? std::string("end") : std::to_string(last)) + ")";
+        }
+        return text;
+    }
+
+    const std::vector<Column>& getSchema() const override {
+        return table.getColumns();
+    }
+
+    bool producesStableRows() const override {
+        return true;
+    }
+};
+
+// Equality lookup through a B-Tree index
+class IndexLookupOperator : public Operator {
+private:
+    const Table& table;
+    const BTreeIndex& index;
+    Value key;
+    const std::vector<size_t>* matches = nullptr;
+    size_t position = 0;
+
+public:
+    IndexLookupOperator(const Table& t, const BTreeIndex& idx, const Value& k)
+        : table(t), index(idx), key(k) {}
+
+    void open() override {
+        matches = index.lookup(key);
+        position = 0;
+    }
+
+    bool next(const Row*& row) override {
+        while (matches && position < matches->size()) {
+            size_t rowIndex = (*matches)[position++];
+            if (rowIndex < table.getRowCount()) {
+                row = &table.getRow(rowIndex);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void close() override {
+        matches = nullptr;
+    }
+
+    std::string describe() const override {
+        return "IndexLookup " + indexName(table, index) + " = " + formatLiteral(key);
+    }
+
+    std::string indexUsed() const override {
+        return indexName(table, index);
+    }
+
+    const std::vector<Column>& getSchema() const override {
+        return table.getColumns();
+    }
+
+    bool producesStableRows() const override {
+        return true;
+    }
+};
+
+// Bounds of an index range scan; a missing bound leaves that side open
+struct KeyRange {
+    bool hasLower = false;
+    bool lowerInclusive = true;
+    Value lower{0};
+    bool hasUpper = false;
+    bool upperInclusive = true;
+    Value upper{0};
+
+    // True when the bounds cross (e.g. id > 5 AND id < 3), so that walking
+    // from first() to last() would run past the end
+    bool isEmpty() const {
+        if (!hasLower || !hasUpper) return false;
+        if (upper < lower) return true;
+        return upper == lower && !(lowerInclusive && upperInclusive);
+    }
+
+    BTreeIndex::Iterator first(const BTreeIndex& index) const {
+        if (!hasLower) return index.begin();
+        return lowerInclusive ? index.lowerBound(lower) : index.upperBound(lower);
+    }
+
+    BTreeIndex::Iterator last(const BTreeIndex& index) const {
+        if (!hasUpper) return index.end();
+        return upperInclusive ? index.upperBound(upper) : index.lowerBound(upper);
+    }
+};
+
+// Walks a B-Tree index over a key range, in ascending or descending key
+// order. Rows sharing a key come out in index order either way.
+class IndexRangeScanOperator : public Operator {
+private:
+    const Table& table;
+    const BTreeIndex& index;
+    KeyRange range;
+    bool descending;
+    BTreeIndex::Iterator current;
+    BTreeIndex::Iterator stop;
+    size_t position = 0;
+
+public:
+    IndexRangeScanOperator(const Table& t, const BTreeIndex& idx, const KeyRange& r, bool desc = false)
+        : table(t), index(idx), range(r), descending(desc) {}
+
+    void open() override {
+        BTreeIndex::Iterator first = range.isEmpty() ? range.last(index) : range.first(index);
+        BTreeIndex::Iterator last = range.last(index);
+        // Descending walks step back from the end of the range before
+        // reading each entry, so current is one past the next entry
+        current = descending ? last : first;
+        stop = descending ? first : last;
+        position = 0;
+    }
+
+    bool next(const Row*& row) override {
+        while (current != stop) {
+            auto entry = descending ? std::prev(current) : current;
+            const auto& rowIds = entry->second;
+            while (position < rowIds.size()) {
+                size_t rowIndex = rowIds[position++];
+                if (rowIndex < table.getRowCount()) {
+                    row = &table.getRow(rowIndex);
+                    return true;
+                }
+            }
+            current = descending ? entry : std::next(current);
+            position = 0;
+        }
+        return false;
+    }
+
+    void close() override {}
+
+    std::string describe() const override {
+        std::string text = "IndexRangeScan " + indexName(table, index) + " ";
+        text += range.hasLower ? (range.lowerInclusive ? "[" : "(") + formatLiteral(range.lower) : "(-inf";
+        text += ", ";
+        text += range.hasUpper ? formatLiteral(range.upper) + (range.upperInclusive ? "]" : ")") : "+inf)";
+        return descending ? text + " DESC" : text;
+    }
+
+    std::string indexUsed() const override {
+        return indexName(table, index);
+    }
+
+    const std::vector<Column>& getSchema() const override {
+        return table.getColumns();
+    }
+
+    bool producesStableRows() const override {
+        return true;
+    }
+};
+
+// Passes through the rows of its child that satisfy a predicate
+class FilterOperator : public Operator {
+private:
+    std::unique_ptr<Operator> child;
+    std::function<bool(const Row&)> predicate;
+    std::string condition; // text of the predicate, for EXPLAIN
+
+public:
+    FilterOperator(std::unique_ptr<Operator> c, std::function<bool(const Row&)> pred, const std::string& text = "")
+        : child(std::move(c)), predicate(std::move(pred)), condition(text) {}
+
+    void open() override {
+        child->open();
+    }
+
+    bool next(const Row*& row) override {
+        while (child->next(row)) {
+            if (predicate(*row)) return true;
+        }
+        return false;
+    }
+
+    void close() override {
+        child->close();
+    }
+
+    std::string describe() const override {
+        return "Filter " + condition;
+    }
+
+    std::vector<std::unique_ptr<Operator>*> inputs() override {
+        return {&child};
+    }
+
+    const std::vector<Column>& getSchema() const override {
+        return child->getSchema();
+    }
+
+    bool producesStableRows() const override {
+        return child->producesStableRows();
+    }
+};
+
+// Keeps a subset of the child's columns, in the given order
+class ProjectOperator : public Operator {
+private:
+    std::unique_ptr<Operator> child;
+    std::vector<size_t> columnIndexes;
+    std::vector<Column> schema;
+    Row buffer;
+
+public:
+    ProjectOperator(std::unique_ptr<Operator> c, const std::vector<size_t>& indexes)
+        : child(std::move(c)), columnIndexes(indexes), buffer(std::vector<Value>()) {
+        const auto& childSchema = child->getSchema();
+        for (size_t idx : columnIndexes) {
+            schema.push_back(childSchema[idx]);
+        }
+    }
+
+    void open() override {
+        child->open();
+    }
+
+    bool next(const Row*& row) override {
+        const Row* input;
+        if (!child->next(input)) return false;
+
+        buffer.values.clear();
+        for (size_t idx : columnIndexes) {
+            buffer.values.push_back((*input)[idx]);
+        }
+        row = &buffer;
+        return true;
+    }
+
+    void close() override {
+        child->close();
+    }
+
+    std::string describe() const override {
+        std::string text = "Project ";
+        for (size_t i = 0; i < schema.size(); i++) {
+            text += (i > 0 ? ", " : "") + schema[i].name;
+        }
+        return text;
+    }
+
+    std::vector<std::unique_ptr<Operator>*> inputs() override {
+        return {&child};
+    }
+
+    const std::vector<Column>& getSchema() const override {
+        return schema;
+    }
+};
+
+// Stops pulling from its child once enough rows have been produced
+class LimitOperator : public Operator {
+private:
+    std::unique_ptr<Operator> child;
+    size_t limit;
+    size_t offset;
+    size_t produced = 0;
+    size_t skipped = 0;
+
+public:
+    LimitOperator(std::unique_ptr<Operator> c, size_t n, size_t skip = 0)
+        : child(std::move(c)), limit(n), offset(skip) {}
+
+    void open() override {
+        produced = 0;
+        skipped = 0;
+        child->open();
+    }
+
+    bool next(const Row*& row) override {
+        if (produced >= limit) return false;
+        for (; skipped < offset; skipped++) {
+            if (!child->next(row)) return false;
+        }
+        if (!child->next(row)) return false;
+        produced++;
+        return true;
+    }
+
+    void close() override {
+        child->close();
+    }
+
+    std::string describe() const override {
+        std::string text = limit == SIZE_MAX ? "Offset" : "Limit " + std::to_string(limit);
+        return offset > 0 ? text + " offset " + std::to_string(offset) : text;
+    }
+
+    std::vector<std::unique_ptr<Operator>*> inputs() override {
+        return {&child};
+    }
+
+    const std::vector<Column>& getSchema() const override {
+        return child->getSchema();
+    }
+
+    bool producesStableRows() const override {
+        return child->producesStableRows();
+    }
+};
+
+// Join algorithm chosen by the planner, or forced with SET join_method
+enum class JoinMethod {
+    AUTO,
+    HASH,
+    INDEX_NESTED_LOOP,
+    MERGE
+};
+
+// Per-query execution settings, taken from the session
+struct ExecutionContext {
+    // Memory an operator may use for its own state (hash tables, sort
+    // buffers) before it spills to disk
+    size_t memoryLimit = 256 * 1024 * 1024;
+    // Directory for spill files, normally data/<db>/tmp
+    std::string tempDir = "data/tmp";
+    JoinMethod joinMethod = JoinMethod::AUTO;
+    // Worker threads a parallel operator may use
+    size_t parallelism = std::max(std::thread::hardware_concurrency(), 1u);
+};
+
+// Approximate heap footprint of a row, for memory accounting
+static size_t rowFootprint(const Row& row) {
+    size_t bytes = sizeof(Row) + row.values.capacity() * sizeof(Value);
+    for (const auto& value : row.values) {
+        if (const auto* text = std::get_if<std::string>(&value.data)) {
+            bytes += text->capacity();
+        }
+    }
+    return bytes;
+}
+
+// Wraps an operator for EXPLAIN ANALYZE, counting the rows it produces and
+// their bytes and timing its open, next and close calls. Times include the
+// operator's inputs.
+class ProfilingOperator : public Operator {
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    std::unique_ptr<Operator> child;
+    size_t rows = 0;
+    size_t bytes = 0;
+    Clock::duration elapsed = Clock::duration::zero();
+
+public:
+    explicit ProfilingOperator(std::unique_ptr<Operator> c) : child(std::move(c)) {
+        estimatedRows = child->estimatedRows;
+    }
+
+    void open() override {
+        auto start = Clock::now();
+        child->open();
+        elapsed += Clock::now() - start;
+    }
+
+    bool next(const Row*& row) override {
+        auto start = Clock::now();
+        bool produced = child->next(row);
+        elapsed += Clock::now() - start;
+        if (produced) {
+            rows++;
+            bytes += rowFootprint(*row);
+        }
+        return produced;
+    }
+
+    void close() override {
+        auto start = Clock::now();
+        child->close();
+        elapsed += Clock::now() - start;
+    }
+
+    const std::vector<Column>& getSchema() const override {
+        return child->getSchema();
+    }
+
+    bool producesStableRows() const override {
+        return child->producesStableRows();
+    }
+
+    std::string describe() const override {
+        return child->describe();
+    }
+
+    std::vector<std::unique_ptr<Operator>*> inputs() override {
+        return child->inputs();
+    }
+
+    std::string indexUsed() const override {
+        return child->indexUsed();
+    }
+
+    size_t getRows() const {
+        return rows;
+    }
+
+    size_t getBytes() const {
+        return bytes;
+    }
+
+    double getMilliseconds() const {
+        return std::chrono::duration<double, std::milli>(elapsed).count();
+    }
+};
+
+// Wraps every operator of a plan in a ProfilingOperator
+static std::unique_ptr<Operator> profilePlan(std::unique_ptr<Operator> plan) {
+    for (auto* input : plan->inputs()) {
+        *input = profilePlan(std::move(*input));
+    }
+    return std::make_unique<ProfilingOperator>(std::move(plan));
+}
+
+// Temporary file of rows, written sequentially and then read back in the
+// same order. The file is deleted when the object is destroyed.
+class SpillFile {
+private:
+    std::string path;
+    std::ofstream out;
+    std::ifstream in;
+    size_t rowCount = 0;
+
+public:
+    SpillFile(const std::string& directory) {
+        static std::atomic<uint64_t> nextId{0};
+        std::filesystem::create_directories(directory);
+        path = directory + "/spill_" + std::to_string(nextId++) + ".tmp";
+        out.open(path, std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) {
+            throw std::runtime_error("cannot create spill file " + path);
+        }
+    }
+
+    ~SpillFile() {
+        out.close();
+        in.close();
+        std::error_code ignored;
+        std::filesystem::remove(path, ignored);
+    }
+
+    void write(const Row& row) {
+        size_t count = row.size();
+        out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+        for (const auto& value : row.values) {
+            writeValue(out, value);
+        }
+        rowCount++;
+    }
+
+    // Switches the file from writing to reading. The file is only opened
+    // again by the first read, so files waiting to be read hold no file
+    // descriptor.
+    void rewind() {
+        out.close();
+        if (out.fail()) {
+            throw std::runtime_error("cannot write spill file " + path);
+        }
+    }
+
+    // Closes the file once it has been read to the end
+    bool read(Row& row) {
+        if (!in.is_open()) {
+            in.open(path, std::ios::binary);
+            if (!in.is_open()) {
+                throw std::runtime_error("cannot open spill file " + path);
+            }
+        }
+        size_t count;
+        if (!in.read(reinterpret_cast<char*>(&count), sizeof(count))) {
+            in.close();
+            return false;
+        }
+        row.values.clear();
+        for (size_t i = 0; i < count; i++) {
+            row.values.push_back(readValue(in));
+        }
+        return true;
+    }
+
+    size_t size() const {
+        return rowCount;
+    }
+};
+
+// Inner equi-join. One input (the build side, chosen by the planner as the
+// smaller one) is loaded into a chained hash table held in flat arrays; the
+// other input is streamed past it one row at a time. Output rows are the
+// left input's columns followed by the right input's.
+//
+// If the hash table outgrows the memory limit, the join switches to a grace
+// hash join: both inputs are split by key hash into partition files, and
+// each pair of partitions is then joined in memory. Partitions that are
+// still too large are split again with a different hash, up to
+// MAX_SPILL_DEPTH levels.
+class HashJoinOperator : public Operator {
+private:
+    static constexpr uint32_t NO_ENTRY = UINT32_MAX;
+    static constexpr size_t PARTITION_FANOUT = 16;
+    static constexpr int MAX_SPILL_DEPTH = 3;
+    // Hash table bookkeeping per build row: row pointer, hash, chain link and
+    // two buckets
+    static constexpr size_t ENTRY_OVERHEAD = sizeof(const Row*) + sizeof(uint64_t) + 3 * sizeof(uint32_t);
+
+    // A pair of partition files still to be joined
+    struct Partition {
+        std::unique_ptr<SpillFile> build;
+        std::unique_ptr<SpillFile> probe;
+        int level;
+    };
+
+    std::unique_ptr<Operator> left;
+    std::unique_ptr<Operator> right;
+    size_t leftKey;
+    size_t rightKey;
+    bool buildLeft;
+    std::vector<Column> schema;
+    ExecutionContext context;
+
+    // Build side. Rows from table-backed inputs are referenced in place,
+    // anything else is copied into ownedRows.
+    std::vector<const Row*> buildRows;
+    std::vector<Row> ownedRows;
+    std::vector<uint64_t> buildHashes;
+    std::vector<uint32_t> bucketHeads; // first entry of each bucket
+    std::vector<uint32_t> chain;       // next entry in the same bucket
+    uint64_t bucketMask = 0;
+    size_t buildBytes = 0;
+
+    // Probe side
+    const Row* probeRow = nullptr;
+    uint64_t probeHash = 0;
+    uint32_t candidate = NO_ENTRY;
+    Row buffer;
+
+    // Grace join state
+    bool partitioned = false;
+    std::vector<Partition> pending;
+    std::unique_ptr<SpillFile> probePartition; // probe rows of the loaded partition
+    Row probeBuffer;
+
+    Operator& buildInput() { return buildLeft ? *left : *right; }
+    Operator& probeInput() { return buildLeft ? *right : *left; }
+    size_t buildKey() const { return buildLeft ? leftKey : rightKey; }
+    size_t probeKey() const { return buildLeft ? rightKey : leftKey; }
+
+    static size_t partitionOf(uint64_t hash, int level) {
+        uint64_t x = hash ^ (0x9e3779b97f4a7c15ULL * static_cast<uint64_t>(level + 1));
+        x ^= x >> 29;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 32;
+        return x % PARTITION_FANOUT;
+    }
+
+    void clearBuildSide() {
+        buildRows = std::vector<const Row*>();
+        ownedRows = std::vector<Row>();
+        buildHashes = std::vector<uint64_t>();
+        bucketHeads = std::vector<uint32_t>();
+        chain = std::vector<uint32_t>();
+        buildBytes = 0;
+    }
+
+    // Adds a row to the build side; returns false once over the memory limit
+    bool addBuildRow(const Row* row, bool stable) {
+        if (stable) {
+            buildRows.push_back(row);
+            buildBytes += ENTRY_OVERHEAD;
+        } else {
+            ownedRows.push_back(*row);
+            buildBytes += ENTRY_OVERHEAD + rowFootprint(*row);
+        }
+        return buildBytes <= context.memoryLimit;
+    }
+
+    void buildHashTable() {
+        for (const Row& owned : ownedRows) {
+            buildRows.push_back(&owned);
+        }
+
+        size_t buckets = 16;
+        while (buckets < buildRows.size() * 2) buckets <<= 1;
+        bucketMask = buckets - 1;
+        bucketHeads.assign(buckets, NO_ENTRY);
+        chain.resize(buildRows.size());
+        buildHashes.resize(buildRows.size());
+
+        for (size_t i = 0; i < buildRows.size(); i++) {
+            uint64_t h = hashValue((*buildRows[i])[buildKey()]);
+            buildHashes[i] = h;
+            chain[i] = bucketHeads[h & bucketMask];
+            bucketHeads[h & bucketMask] = static_cast<uint32_t>(i);
+        }
+    }
+
+    std::vector<std::unique_ptr<SpillFile>> createPartitionFiles() {
+        std::vector<std::unique_ptr<SpillFile>> files;
+        for (size_t i = 0; i < PARTITION_FANOUT; i++) {
+            files.push_back(std::make_unique<SpillFile>(context.tempDir));
+        }
+        return files;
+    }
+
+    // Moves the rows collected so far plus the rest of both row sources into
+    // partition files, and queues the partition pairs for joining
+    template <typename BuildSource, typename ProbeSource>
+    void spill(int level, BuildSource nextBuildRow, ProbeSource nextProbeRow) {
+        auto buildFiles = createPartitionFiles();
+        auto probeFiles = createPartitionFiles();
+
+        for (const Row* row : buildRows) {
+            buildFiles[partitionOf(hashValue((*row)[buildKey()]), level)]->write(*row);
+        }
+        for (const Row& row : ownedRows) {
+            buildFiles[partitionOf(hashValue(row[buildKey()]), level)]->write(row);
+        }
+        clearBuildSide();
+
+        const Row* row;
+        while (nextBuildRow(row)) {
+            buildFiles[partitionOf(hashValue((*row)[buildKey()]), level)]->write(*row);
+        }
+        while (nextProbeRow(row)) {
+            probeFiles[partitionOf(hashValue((*row)[probeKey()]), level)]->write(*row);
+        }
+
+        // Queued in reverse so partition 0 is joined first
+        for (size_t i = PARTITION_FANOUT; i-- > 0;) {
+            buildFiles[i]->rewind();
+            probeFiles[i]->rewind();
+            pending.push_back({std::move(buildFiles[i]), std::move(probeFiles[i]), level});
+        }
+    }
+
+    // Loads the next non-empty partition pair into memory, splitting it
+    // further if its build side does not fit
+    bool loadNextPartition() {
+        probePartition.reset();
+        clearBuildSide();
+
+        while (!pending.empty()) {
+            Partition partition = std::move(pending.back());
+            pending.pop_back();
+            if (partition.build->size() == 0 || partition.probe->size() == 0) continue;
+
+            ownedRows.reserve(partition.build->size());
+            bool fits = true;
+            Row row(std::vector<Value>{});
+            while (fits && partition.build->read(row)) {
+                fits = addBuildRow(&row, false);
+            }
+
+            if (!fits && partition.level + 1 < MAX_SPILL_DEPTH) {
+                SpillFile& buildFile = *partition.build;
+                SpillFile& probeFile = *partition.probe;
+                Row buildRow(std::vector<Value>{});
+                Row probeRowBuffer(std::vector<Value>{});
+                spill(partition.level + 1,
+                      [&](const Row*& next) { next = &buildRow; return buildFile.read(buildRow); },
+                      [&](const Row*& next) { next = &probeRowBuffer; return probeFile.read(probeRowBuffer); });
+                continue;
+            }
+
+            // At the last level a partition is joined however large it is;
+            // only heavily duplicated keys end up here
+            while (partition.build->read(row)) {
+                addBuildRow(&row, false);
+            }
+            buildHashTable();
+            probePartition = std::move(partition.probe);
+            return true;
+        }
+        return false;
+    }
+
+    bool nextProbeRow() {
+        if (!partitioned) {
+            return probeInput().next(probeRow);
+        }
+        if (!probePartition || !probePartition->read(probeBuffer)) return false;
+        probeRow = &probeBuffer;
+        return true;
+    }
+
+    void emit(const Row& buildRow) {
+        const Row& leftRow = buildLeft ? buildRow : *probeRow;
+        const Row& rightRow = buildLeft ? *probeRow : buildRow;
+        buffer.values.clear();
+        buffer.values.insert(buffer.values.end(), leftRow.values.begin(), leftRow.values.end());
+        buffer.values.insert(buffer.values.end(), rightRow.values.begin(), rightRow.values.end());
+    }
+
+public:
+    HashJoinOperator(std::unique_ptr<Operator> l, std::unique_ptr<Operator> r, size_t lKey, size_t rKey,
+                     bool buildOnLeft, const std::vector<Column>& outputSchema, const ExecutionContext& ctx)
+        : left(std::move(l)), right(std::move(r)), leftKey(lKey), rightKey(rKey), buildLeft(buildOnLeft),
+          schema(outputSchema), context(ctx), buffer(std::vector<Value>()), probeBuffer(std::vector<Value>()) {}
+
+    void open() override {
+        left->open();
+        right->open();
+        probeRow = nullptr;
+        candidate = NO_ENTRY;
+        partitioned = false;
+        pending.clear();
+        probePartition.reset();
+
+        Operator& input = buildInput();
+        bool stable = input.producesStableRows();
+        const Row* row;
+        bool fits = true;
+        while (fits && input.next(row)) {
+            fits = addBuildRow(row, stable);
+        }
+
+        if (fits) {
+            buildHashTable();
+            return;
+        }
+
+        partitioned = true;
+        spill(0,
+              [&](const Row*& next) { return buildInput().next(next); },
+              [&](const Row*& next) { return probeInput().next(next); });
+        loadNextPartition();
+    }
+
+    bool next(const Row*& row) override {
+        while (true) {
+            while (candidate != NO_ENTRY) {
+                uint32_t entry = candidate;
+                candidate = chain[entry];
+                const Row& buildRow = *buildRows[entry];
+                if (buildHashes[entry] == probeHash && buildRow[buildKey()] == (*probeRow)[probeKey()]) {
+                    emit(buildRow);
+                    row = &buffer;
+                    return true;
+                }
+            }
+
+            if (!nextProbeRow()) {
+                if (partitioned && loadNextPartition()) continue;
+                probeRow = nullptr;
+                return false;
+            }
+            probeHash = hashValue((*probeRow)[probeKey()]);
+            candidate = bucketHeads[probeHash & bucketMask];
+        }
+    }
+
+    void close() override {
+        left->close();
+        right->close();
+        clearBuildSide();
+        pending.clear();
+        probePartition.reset();
+    }
+
+    std::string describe() const override {
+        return "HashJoin " + left->getSchema()[leftKey].name + " = " + right->getSchema()[rightKey].name +
+               (buildLeft ? " (build left)" : " (build right)");
+    }
+
+    std::vector<std::unique_ptr<Operator>*> inputs() override {
+        return {&left, &right};
+    }
+
+    const std::vector<Column>& getSchema() const override {
+        return schema;
+    }
+};
+
+// Join that looks up each outer row's key in an index on the inner table,
+// so the inner table is never scanned. Best when the outer input is small.
+// Inner rows must also pass innerFilter, if given. Output rows are the left
+// input's columns followed by the right input's, whichever side is outer.
+class IndexNestedLoopJoinOperator : public Operator {
+private:
+    std::unique_ptr<Operator> outer;
+    const Table& inner;
+    const BTreeIndex& index;
+    size_t outerKey;
+    std::function<bool(const Row&)> innerFilter;
+    bool outerIsLeft;
+    std::vector<Column> schema;
+
+    const Row* outerRow = nullptr;
+    const std::vector<size_t>* matches = nullptr;
+    size_t position = 0;
+    Row buffer;
+
+public:
+    IndexNestedLoopJoinOperator(std::unique_ptr<Operator> outerInput, const Table& innerTable,
+                                const BTreeIndex& innerIndex, size_t outerKeyIndex,
+                                std::function<bool(const Row&)> filter, bool outerOnLeft,
+                                const std::vector<Column>& outputSchema)
+        : outer(std::move(outerInput)), inner(innerTable), index(innerIndex), outerKey(outerKeyIndex),
+          innerFilter(std::move(filter)), outerIsLeft(outerOnLeft), schema(outputSchema),
+          buffer(std::vector<Value>()) {}
+
+    void open() override {
+        outer->open();
+        matches = nullptr;
+        position = 0;
+    }
+
+    bool next(const Row*& row) override {
+        while (true) {
+            while (matches && position < matches->size()) {
+                size_t rowIndex = (*matches)[position++];
+                if (rowIndex >= inner.getRowCount()) continue;
+
+                const Row& innerRow = inner.getRow(rowIndex);
+                if (innerFilter && !innerFilter(innerRow)) continue;
+
+                const Row& leftRow = outerIsLeft ? *outerRow : innerRow;
+                const Row& rightRow = outerIsLeft ? innerRow : *outerRow;
+                buffer.values.clear();
+                buffer.values.insert(buffer.values.end(), leftRow.values.begin(), leftRow.values.end());
+                buffer.values.insert(buffer.values.end(), rightRow.values.begin(), rightRow.values.end());
+                row = &buffer;
+                return true;
+            }
+
+            if (!outer->next(outerRow)) return false;
+            matches = index.lookup((*outerRow)[outerKey]);
+            position = 0;
+        }
+    }
+
+    void close() override {
+        outer->close();
+        matches = nullptr;
+    }
+
+    std::string describe() const override {
+        return "IndexNestedLoopJoin " + outer->getSchema()[outerKey].name + " probes " + indexName(inner, index) +
+               (outerIsLeft ? "" : " (inner on the left)");
+    }
+
+    std::vector<std::unique_ptr<Operator>*> inputs() override {
+        return {&outer};
+    }
+
+    std::string indexUsed() const override {
+        return indexName(inner, index);
+    }
+
+    const std::vector<Column>& getSchema() const override {
+        return schema;
+    }
+};
+
+struct SortKey {
+    size_t column;
+    bool descending = false;
+};
+
+// "a, b DESC", for EXPLAIN
+static std::string describeSortKeys(const std::vector<SortKey>& keys, const std::vector<Column>& schema) {
+    std::string text;
+    for (size_t i = 0; i < keys.size(); i++) {
+        text += (i > 0 ? ", " : "") + schema[keys[i].column].name + (keys[i].descending ? " DESC" : "");
+    }
+    return text;
+}
+
+// Appends the sort key columns of a row to out as a byte string whose
+// memcmp order is the compareRows order, so sorting compares plain bytes
+// instead of dispatching on Value types for every comparison. Each column
+// is a type byte (types order first, as in compareForSort) followed by an
+// order-preserving encoding of the value; descending columns are inverted.
+static void encodeSortKey(const Row& row, const std::vector<SortKey>& keys, std::string& out) {
+    for (const auto& key : keys) {
+        const Value& value = row[key.column];
+        size_t start = out.size();
+        out.push_back(static_cast<char>(value.type));
+
+        uint64_t bits = 0;
+        int width = 0;
+        switch (value.type) {
+            case DataType::INTEGER:
+                bits = static_cast<uint32_t>(std::get<int>(value.data)) ^ 0x80000000u;
+                width = 4;
+                break;
+            case DataType::REAL: {
+                double real = std::get<double>(value.data);
+                if (real == 0) real = 0; // -0.0 sorts equal to 0.0
+                std::memcpy(&bits, &real, sizeof(bits));
+                bits = (bits & 0x8000000000000000ULL) ? ~bits : bits | 0x8000000000000000ULL;
+                width = 8;
+                break;
+            }
+            case DataType::BOOLEAN:
+                bits = std::get<bool>(value.data) ? 1 : 0;
+                width = 1;
+                break;
+            case DataType::TEXT:
+                // Zero bytes are escaped so the 0x00 0x00 terminator sorts
+                // shorter strings before their extensions
+                for (char c : std::get<std::string>(value.data)) {
+                    out.push_back(c);
+                    if (c == '\0') out.push_back('\xff');
+                }
+                out.append(2, '\0');
+                break;
+        }
+        for (int shift = (width - 1) * 8; shift >= 0; shift -= 8) {
+            out.push_back(static_cast<char>(bits >> shift));
+        }
+
+        if (key.descending) {
+            for (size_t i = start; i < out.size(); i++) {
+                out[i] = static_cast<char>(~out[i]);
+            }
+        }
+    }
+}
+
+// Sorts its input. Rows are collected with their normalised sort keys (see
+// encodeSortKey) and sorted in memory, in parallel for large buffers; if they
+// exceed the memory limit, each full buffer is written out as a sorted run
+// and the runs are combined with a k-way merge. The sort is stable.
+class SortOperator : public Operator {
+private:
+    // Runs read at once by one merge; more runs are first merged in passes
+    // over groups of this many, which keeps open files well below the limit
+    static constexpr size_t MAX_MERGE_RUNS = 64;
+
+    struct Entry {
+        std::string key;
+        const Row* row;
+    };
+
+    std::unique_ptr<Operator> child;
+    std::vector<SortKey> keys;
+    ExecutionContext context;
+
+    // In-memory buffer. Table-backed rows are referenced in place, others
+    // are copied into ownedRows (a deque, so references stay valid).
+    std::vector<Entry> sorted;
+    std::deque<Row> ownedRows;
+    size_t bufferBytes = 0;
+    size_t position = 0;
+
+    // External merge state: one spill file per run and its current row
+    std::vector<std::unique_ptr<SpillFile>> runs;
+    std::vector<Row> runHeads;
+    std::vector<std::string> runHeadKeys;
+    std::vector<size_t> heap; // run numbers, ordered by their head rows
+
+    bool runBefore(size_t a, size_t b) const {
+        int cmp = runHeadKeys[a].compare(runHeadKeys[b]);
+        return cmp < 0 || (cmp == 0 && a < b); // earlier runs first keeps the merge stable
+    }
+
+    bool readRunHead(size_t run) {
+        if (!runs[run]->read(runHeads[run])) return false;
+        runHeadKeys[run].clear();
+        encodeSortKey(runHeads[run], keys, runHeadKeys[run]);
+        return true;
+    }
+
+    void sortBuffer();
+
+    void spillRun() {
+        sortBuffer();
+        auto run = std::make_unique<SpillFile>(context.tempDir);
+        for (const Entry& entry : sorted) {
+            run->write(*entry.row);
+        }
+        run->rewind();
+        runs.push_back(std::move(run));
+
+        sorted.clear();
+        ownedRows.clear();
+        bufferBytes = 0;
+    }
+
+    void pushHeap(size_t run) {
+        heap.push_back(run);
+        std::push_heap(heap.begin(), heap.end(), [this](size_t a, size_t b) { return runBefore(b, a); });
+    }
+
+    size_t popHeap() {
+        std::pop_heap(heap.begin(), heap.end(), [this](size_t a, size_t b) { return runBefore(b, a); });
+        size_t run = heap.back();
+        heap.pop_back();
+        return run;
+    }
+
+    // Loads the first row of each run in [first, last) into the heap
+    void startMerge(size_t first, size_t last) {
+        runHeads.assign(runs.size(), Row(std::vector<Value>()));
+        runHeadKeys.assign(runs.size(), std::string());
+        heap.clear();
+        for (size_t i = first; i < last; i++) {
+            if (readRunHead(i)) {
+                pushHeap(i);
+            }
+        }
+    }
+
+    // Merges groups of consecutive runs into one run each until at most
+    // MAX_MERGE_RUNS are left. Keeping the groups in run order keeps the
+    // sort stable.
+    void reduceRuns() {
+        while (runs.size() > MAX_MERGE_RUNS) {
+            std::vector<std::unique_ptr<SpillFile>> merged;
+            for (size_t first = 0; first < runs.size(); first += MAX_MERGE_RUNS) {
+                size_t last = std::min(first + MAX_MERGE_RUNS, runs.size());
+                auto output = std::make_unique<SpillFile>(context.tempDir);
+                startMerge(first, last);
+                while (!heap.empty()) {
+                    size_t run = popHeap();
+                    output->write(runHeads[run]);
+                    if (readRunHead(run)) {
+                        pushHeap(run);
+                    }
+                }
+                output->rewind();
+                for (size_t i = first; i < last; i++) {
+                    runs[i].reset();
+                }
+                merged.push_back(std::move(output));
+            }
+            runs = std::move(merged);
+        }
+    }
+
+public:
+    SortOperator(std::unique_ptr<Operator> c, const std::vector<SortKey>& sortKeys, const ExecutionContext& ctx)
+        : child(std::move(c)), keys(sortKeys), context(ctx) {}
+
+    void open() override {
+        child->open();
+        sorted.clear();
+        ownedRows.clear();
+        runs.clear();
+        runHeads.clear();
+        runHeadKeys.clear();
+        heap.clear();
+        bufferBytes = 0;
+        position = 0;
+
+        bool stable = child->producesStableRows();
+        const Row* row;
+        while (child->next(row)) {
+            if (!stable) {
+                ownedRows.push_back(*row);
+                row = &ownedRows.back();
+                bufferBytes += rowFootprint(*row);
+            }
+            sorted.push_back({std::string(), row});
+            encodeSortKey(*row, keys, sorted.back().key);
+            bufferBytes += sizeof(Entry) + sorted.back().key.capacity();
+            if (bufferBytes > context.memoryLimit) {
+                spillRun();
+            }
+        }
+
+        if (runs.empty()) {
+            sortBuffer();
+            return;
+        }
+
+        if (!sorted.empty()) {
+            spillRun();
+        }
+        reduceRuns();
+        startMerge(0, runs.size());
+    }
+
+    bool next(const Row*& row) override {
+        if (runs.empty()) {
+            if (position >= sorted.size()) return false;
+            row = sorted[position++].row;
+            return true;
+        }
+
+        // The row handed out last time is replaced by its run's next row
+        // only now, so the pointer stayed valid until this call
+        if (position > 0) {
+            size_t run = position - 1;
+            if (readRunHead(run)) {
+                pushHeap(run);
+            }
+            position = 0;
+        }
+        if (heap.empty()) return false;
+
+        size_t run = popHeap();
+        row = &runHeads[run];
+        position = run + 1;
+        return true;
+    }
+
+    void close() override {
+        child->close();
+        sorted = std::vector<Entry>();
+        ownedRows = std::deque<Row>();
+        runs.clear();
+        runHeads.clear();
+        runHeadKeys.clear();
+        heap.clear();
+    }
+
+    std::string describe() const override {
+        return "Sort by " + describeSortKeys(keys, child->getSchema());
+    }
+
+    std::vector<std::unique_ptr<Operator>*> inputs() override {
+        return {&child};
+    }
+
+    const std::vector<Column>& getSchema() const override {
+        return child->getSchema();
+    }
+};
+
+// Produces the first n rows of its input in sort order without sorting all
+// of it: a max-heap holds the n best rows seen so far and each new row only
+// has to beat the worst of them, so the cost is O(rows * log n). Ties keep
+// input order, like SortOperator.
+class TopNOperator : public Operator {
+private:
+    struct Entry {
+        std::string key;
+        size_t sequence;
+        const Row* row;
+        size_t slot; // index into ownedRows when the row is a copy
+    };
+
+    std::unique_ptr<Operator> child;
+    std::vector<SortKey> keys;
+    size_t limit;
+
+    std::vector<Entry> heap;
+    std::deque<Row> ownedRows; // copies of unstable input rows, one per heap slot
+    size_t position = 0;
+
+    static bool before(const Entry& a, const Entry& b) {
+        int cmp = a.key.compare(b.key);
+        return cmp < 0 || (cmp == 0 && a.sequence < b.sequence);
+    }
+
+public:
+    TopNOperator(std::unique_ptr<Operator> c, const std::vector<SortKey>& sortKeys, size_t n)
+        : child(std::move(c)), keys(sortKeys), limit(n) {}
+
+    void open() override {
+        child->open();
+        heap.clear();
+        ownedRows.clear();
+        position = 0;
+        if (limit == 0) return;
+
+        bool stable = child->producesStableRows();
+        std::string key;
+        size_t sequence = 0;
+        const Row* row;
+        while (child->next(row)) {
+            key.clear();
+            encodeSortKey(*row, keys, key);
+
+            if (heap.size() < limit) {
+                size_t slot = ownedRows.size();
+                if (!stable) {
+                    ownedRows.push_back(*row);
+                    row = &ownedRows.back();
+                }
+                heap.push_back({std::move(key), sequence++, row, slot});
+                std::push_heap(heap.begin(), heap.end(), before);
+                continue;
+            }
+
+            // Later rows lose ties, so only a strictly smaller key gets in
+            sequence++;
+            if (key >= heap.front().key) continue;
+
+            std::pop_heap(heap.begin(), heap.end(), before);
+            Entry& slot = heap.back();
+            if (!stable) {
+                // Reuse the evicted row's copy
+                ownedRows[slot.slot] = *row;
+                row = &ownedRows[slot.slot];
+            }
+            slot.key.swap(key);
+            slot.sequence = sequence - 1;
+            slot.row = row;
+            std::push_heap(heap.begin(), heap.end(), before);
+        }
+        std::sort_heap(heap.begin(), heap.end(), before);
+    }
+
+    bool next(const Row*& row) override {
+        if (position >= heap.size()) return false;
+        row = heap[position++].row;
+        return true;
+    }
+
+    void close() override {
+        child->close();
+        heap = std::vector<Entry>();
+        ownedRows = std::deque<Row>();
+    }
+
+    std::string describe() const override {
+        return "TopN " + std::to_string(limit) + " by " + describeSortKeys(keys, child->getSchema());
+    }
+
+    std::vector<std::unique_ptr<Operator>*> inputs() override {
+        return {&child};
+    }
+
+    const std::vector<Column>& getSchema() const override {
+        return child->getSchema();
+    }
+
+    bool producesStableRows() const override {
+        return child->producesStableRows();
+    }
+};
+
+// Inner equi-join of two inputs that are both sorted ascending on their join
+// keys (in compareForSort order). Right rows sharing a key are buffered so
+// that each left row with that key can be paired with all of them. Output
+// rows are the left input's columns followed by the right input's.
+class MergeJoinOperator : public Operator {
+private:
+    std::unique_ptr<Operator> left;
+    std::unique_ptr<Operator> right;
+    size_t leftKey;
+    size_t rightKey;
+    std::vector<Column> schema;
+
+    const Row* leftRow = nullptr;
+    const Row* rightRow = nullptr; // next right row not yet in a group
+    std::vector<Row> group;        // right rows with the current key
+    size_t groupPosition = 0;
+    bool inGroup = false;
+    Row buffer;
+
+public:
+    MergeJoinOperator(std::unique_ptr<Operator> l, std::unique_ptr<Operator> r, size_t lKey, size_t rKey,
+                      const std::vector<Column>& outputSchema)
+        : left(std::move(l)), right(std::move(r)), leftKey(lKey), rightKey(rKey), schema(outputSchema),
+          buffer(std::vector<Value>()) {}
+
+    void open() override {
+        left->open();
+        right->open();
+        group.clear();
+        inGroup = false;
+        groupPosition = 0;
+        if (!left->next(leftRow)) leftRow = nullptr;
+        if (!right->next(rightRow)) rightRow = nullptr;
+    }
+
+    bool next(const Row*& row) override {
+        while (leftRow) {
+            if (inGroup) {
+                if (groupPosition < group.size()) {
+                    const Row& match = group[groupPosition++];
+                    buffer.values.clear();
+                    buffer.values.insert(buffer.values.end(), leftRow->values.begin(), leftRow->values.end());
+                    buffer.values.insert(buffer.values.end(), match.values.begin(), match.values.end());
+                    row = &buffer;
+                    return true;
+                }
+
+                // Next left row; it may share the key of the current group
+                if (!left->next(leftRow)) leftRow = nullptr;
+                if (leftRow && compareForSort((*leftRow)[leftKey], group[0][rightKey]) == 0) {
+                    groupPosition = 0;
+                } else {
+                    inGroup = false;
+                }
+                continue;
+            }
+
+            if (!rightRow) break;
+
+            int cmp = compareForSort((*leftRow)[leftKey], (*rightRow)[rightKey]);
+            if (cmp < 0) {
+                if (!left->next(leftRow)) leftRow = nullptr;
+            } else if (cmp > 0) {
+                if (!right->next(rightRow)) rightRow = nullptr;
+            } else {
+                group.clear();
+                Value key = (*rightRow)[rightKey];
+                while (rightRow && compareForSort((*rightRow)[rightKey], key) == 0) {
+                    group.push_back(*rightRow);
+                    if (!right->next(rightRow)) rightRow = nullptr;
+                }
+                inGroup = true;
+                groupPosition = 0;
+            }
+        }
+        return false;
+    }
+
+    void close() override {
+        left->close();
+        right->close();
+        group.clear();
+        leftRow = nullptr;
+        rightRow = nullptr;
+    }
+
+    std::string describe() const override {
+        return "MergeJoin " + left->getSchema()[leftKey].name + " = " + right->getSchema()[rightKey].name;
+    }
+
+    std::vector<std::unique_ptr<Operator>*> inputs() override {
+        return {&left, &right};
+    }
+
+    const std::vector<Column>& getSchema() const override {
+        return schema;
+    }
+};
+
+// Task scheduling
+//
+// Parallel operators run their work as tasks on one process-wide pool of
+// worker threads, so concurrent queries share a fixed number of threads.
+// Each worker owns a Chase-Lev deque: it pushes and pops tasks at the bottom
+// without locking, while idle workers steal from the top with a single CAS.
+// Tasks submitted from outside the pool go to a shared injection queue.
+
+class TaskGroup;
+
+struct Task {
+    std::function<void()> run;
+    TaskGroup* group;
+};
+
+class WorkStealingDeque {
+private:
+    // Ring buffer of task pointers; indexes grow without bound and wrap
+    struct Buffer {
+        int64_t capacity;
+        std::unique_ptr<std::atomic<Task*>[]> slots;
+
+        Buffer(int64_t c) : capacity(c), slots(new std::atomic<Task*>[c]) {}
+
+        Task* get(int64_t i) const {
+            return slots[i & (capacity - 1)].load(std::memory_order_relaxed);
+        }
+
+        void put(int64_t i, Task* task) {
+            slots[i & (capacity - 1)].store(task, std::memory_order_relaxed);
+        }
+    };
+
+    std::atomic<int64_t> top{0};
+    std::atomic<int64_t> bottom{0};
+    std::atomic<Buffer*> buffer;
+    // Every buffer ever used; thieves may still be reading an old one after
+    // a resize, so they are only freed with the deque
+    std::vector<std::unique_ptr<Buffer>> buffers;
+
+public:
+    WorkStealingDeque() {
+        buffers.push_back(std::make_unique<Buffer>(256));
+        buffer.store(buffers.back().get(), std::memory_order_relaxed);
+    }
+
+    // Owner only
+    void push(Task* task) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        Buffer* current = buffer.load(std::memory_order_relaxed);
+        if (b - t >= current->capacity) {
+            buffers.push_back(std::make_unique<Buffer>(current->capacity * 2));
+            Buffer* grown = buffers.back().get();
+            for (int64_t i = t; i < b; i++) {
+                grown->put(i, current->get(i));
+            }
+            buffer.store(grown, std::memory_order_release);
+            current = grown;
+        }
+        current->put(b, task);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    // Owner only; takes the most recently pushed task
+    Task* pop() {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        Buffer* current = buffer.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        Task* task = current->get(b);
+        if (t == b) {
+            // Last task: race thieves for it
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                task = nullptr;
+            }
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return task;
+    }
+
+    // Any thread; takes the oldest task
+    Task* steal() {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b) return nullptr;
+        Task* task = buffer.load(std::memory_order_acquire)->get(t);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return task;
+    }
+};
+
+class ThreadPool {
+private:
+    struct Worker {
+        WorkStealingDeque tasks;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::deque<Task*> injected;
+    std::mutex injectedMutex;
+    std::atomic<size_t> queued{0}; // tasks waiting in any queue
+    std::mutex sleepMutex;
+    std::condition_variable wakeUp;
+    std::atomic<bool> shuttingDown{false};
+    std::mutex configMutex;
+    // Held shared while the workers' deques are used and exclusively while
+    // configure replaces the workers
+    std::shared_mutex workersMutex;
+    size_t workerCount = 0;
+    bool pinned = false;
+
+    // Index of the pool worker running on this thread, -1 elsewhere
+    static int& currentWorker() {
+        static thread_local int index = -1;
+        return index;
+    }
+
+    static void pinToCore(std::thread& thread, size_t core) {
+#ifdef __linux__
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(core % std::max(std::thread::hardware_concurrency(), 1u), &cpus);
+        pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus);
+#else
+        (void)thread;
+        (void)core;
+#endif
+    }
+
+    Task* takeInjected() {
+        std::lock_guard<std::mutex> guard(injectedMutex);
+        if (injected.empty()) return nullptr;
+        Task* task = injected.front();
+        injected.pop_front();
+        return task;
+    }
+
+    // Own deque first, then the injection queue, then the other workers
+    Task* findTask(int self) {
+        std::shared_lock<std::shared_mutex> workersGuard(workersMutex);
+        Task* task = self >= 0 ? workers[self]->tasks.pop() : nullptr;
+        if (!task) task = takeInjected();
+        for (size_t i = 0; !task && i < workers.size(); i++) {
+            size_t victim = (self + 1 + i) % workers.size();
+            if (static_cast<int>(victim) != self) task = workers[victim]->tasks.steal();
+        }
+        if (task) queued--;
+        return task;
+    }
+
+    void execute(Task* task);
+
+    void workerLoop(int index) {
+        currentWorker() = index;
+        while (!shuttingDown) {
+            if (Task* task = findTask(index)) {
+                execute(task);
+                continue;
+            }
+            std::unique_lock<std::mutex> guard(sleepMutex);
+            wakeUp.wait(guard, [this] { return shuttingDown || queued > 0; });
+        }
+    }
+
+    void start(size_t count, bool pin) {
+        std::unique_lock<std::shared_mutex> workersGuard(workersMutex);
+        shuttingDown = false;
+        for (size_t i = 0; i < count; i++) {
+            workers.push_back(std::make_unique<Worker>());
+        }
+        for (size_t i = 0; i < count; i++) {
+            workers[i]->thread = std::thread(&ThreadPool::workerLoop, this, static_cast<int>(i));
+            if (pin) pinToCore(workers[i]->thread, i);
+        }
+        workerCount = count;
+        pinned = pin;
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> guard(sleepMutex);
+            shuttingDown = true;
+        }
+        wakeUp.notify_all();
+        for (auto& worker : workers) {
+            worker->thread.join();
+        }
+
+        // Tasks that workers submitted to their own deques and nobody ran
+        // yet still count as queued; the injection queue keeps them for the
+        // next workers or for threads waiting on their group
+        std::unique_lock<std::shared_mutex> workersGuard(workersMutex);
+        {
+            std::lock_guard<std::mutex> guard(injectedMutex);
+            for (auto& worker : workers) {
+                while (Task* task = worker->tasks.steal()) {
+                    injected.push_back(task);
+                }
+            }
+        }
+        workers.clear();
+    }
+
+    ThreadPool() {
+        start(std::max(std::thread::hardware_concurrency(), 1u), false);
+    }
+
+public:
+    ~ThreadPool() {
+        stop();
+    }
+
+    // The pool shared by all queries in the process
+    static ThreadPool& shared() {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    // Restarts the workers with a new thread count and pinning. Queries may
+    // keep running: tasks queued on the old workers move to the injection
+    // queue and are picked up by the new ones.
+    void configure(size_t count, bool pin) {
+        std::lock_guard<std::mutex> guard(configMutex);
+        stop();
+        start(std::max<size_t>(count, 1), pin);
+    }
+
+    size_t getWorkerCount() const {
+        return workerCount;
+    }
+
+    bool isPinned() const {
+        return pinned;
+    }
+
+    void submit(Task* task) {
+        int self = currentWorker();
+        {
+            std::shared_lock<std::shared_mutex> workersGuard(workersMutex);
+            if (self >= 0 && static_cast<size_t>(self) < workers.size() && !shuttingDown) {
+                workers[self]->tasks.push(task);
+            } else {
+                std::lock_guard<std::mutex> guard(injectedMutex);
+                injected.push_back(task);
+            }
+        }
+        {
+            // Published under sleepMutex so a thread that has just found
+            // nothing to run cannot miss it and sleep
+            std::lock_guard<std::mutex> guard(sleepMutex);
+            queued++;
+        }
+        wakeUp.notify_one();
+    }
+
+    // Blocks until ready() holds or a task is queued for the caller to help
+    // with. ready() is checked under sleepMutex, so whoever makes it true
+    // must call wakeWaiters() afterwards.
+    template <typename Ready>
+    void waitUntil(Ready ready) {
+        std::unique_lock<std::mutex> guard(sleepMutex);
+        wakeUp.wait(guard, [&] { return ready() || queued > 0; });
+    }
+
+    void wakeWaiters() {
+        { std::lock_guard<std::mutex> guard(sleepMutex); }
+        wakeUp.notify_all();
+    }
+
+    // Runs one queued task on the calling thread, if there is one; threads
+    // waiting for tasks to finish call this to help instead of idling
+    bool runPendingTask() {
+        Task* task = findTask(currentWorker());
+        if (!task) return false;
+        execute(task);
+        return true;
+    }
+
+    // Calls body(i) for every i in [0, count) as separate tasks and returns
+    // once all have finished
+    template <typename Body>
+    void parallelFor(size_t count, Body body);
+};
+
+// Tasks submitted together so that their submitter can wait for all of them
+class TaskGroup {
+private:
+    std::atomic<size_t> pending{0};
+    std::atomic<bool> failed{false};
+    std::mutex mutex;
+    std::exception_ptr error; // first exception thrown by one of the tasks
+
+    void drain() {
+        ThreadPool& pool = ThreadPool::shared();
+        while (pending > 0) {
+            if (pool.runPendingTask()) continue;
+            pool.waitUntil([this] { return pending == 0; });
+        }
+    }
+
+public:
+    ~TaskGroup() {
+        drain();
+    }
+
+    void submit(std::function<void()> run) {
+        pending++;
+        ThreadPool::shared().submit(new Task{std::move(run), this});
+    }
+
+    // Called by the pool after one of the group's tasks has run. The group
+    // is not touched once pending drops to zero, since wait() may return
+    // and destroy it right then.
+    void finished() {
+        if (--pending == 0) {
+            ThreadPool::shared().wakeWaiters();
+        }
+    }
+
+    // Called by the pool when one of the group's tasks threw
+    void fail(std::exception_ptr exception) {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            if (!error) error = exception;
+        }
+        failed = true;
+        ThreadPool::shared().wakeWaiters();
+    }
+
+    bool hasFailed() const {
+        return failed;
+    }
+
+    // Helps run queued tasks until every task of this group has finished,
+    // then rethrows the first exception any of them threw
+    void wait() {
+        drain();
+        std::exception_ptr exception;
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            std::swap(exception, error);
+        }
+        if (exception) std::rethrow_exception(exception);
+    }
+};
+
+inline void ThreadPool::execute(Task* task) {
+    TaskGroup* group = task->group;
+    try {
+        task->run();
+    } catch (...) {
+        group->fail(std::current_exception());
+    }
+    delete task;
+    group->finished();
+}
+
+template <typename Body>
+void ThreadPool::parallelFor(size_t count, Body body) {
+    TaskGroup group;
+    for (size_t i = 0; i < count; i++) {
+        group.submit([&body, i] { body(i); });
+    }
+    group.wait();
+}
+
+// Chunks smaller than this are not worth a task of their own
+static constexpr size_t PARALLEL_SORT_MIN_CHUNK = 8192;
+
+// Stable sort on the shared pool: up to parallelism chunks are sorted as
+// separate tasks, then neighbouring chunks are merged pairwise, each round
+// of merges again in parallel. Small inputs are sorted on the calling thread.
+template <typename T, typename Less>
+void parallelStableSort(std::vector<T>& items, Less less, size_t parallelism) {
+    size_t chunks = std::min(parallelism, items.size() / PARALLEL_SORT_MIN_CHUNK);
+    if (chunks < 2) {
+        std::stable_sort(items.begin(), items.end(), less);
+        return;
+    }
+
+    std::vector<size_t> bounds(chunks + 1);
+    for (size_t c = 0; c <= chunks; c++) {
+        bounds[c] = items.size() * c / chunks;
+    }
+    auto at = [&items](size_t position) { return items.begin() + position; };
+
+    ThreadPool& pool = ThreadPool::shared();
+    pool.parallelFor(chunks, [&](size_t c) { std::stable_sort(at(bounds[c]), at(bounds[c + 1]), less); });
+    for (size_t width = 1; width < chunks; width *= 2) {
+        size_t merges = (chunks + 2 * width - 1) / (2 * width);
+        pool.parallelFor(merges, [&](size_t m) {
+            size_t low = m * 2 * width;
+            size_t middle = std::min(low + width, chunks);
+            size_t high = std::min(low + 2 * width, chunks);
+            if (middle < high) {
+                std::inplace_merge(at(bounds[low]), at(bounds[middle]), at(bounds[high]), less);
+            }
+        });
+    }
+}
+
+// Storage and sort members that run on the pool, defined once it is declared
+
+inline void BTreeIndex::bulkLoad(std::vector<std::pair<Value, size_t>> entries, size_t parallelism) {
+    parallelStableSort(entries, [](const std::pair<Value, size_t>& a, const std::pair<Value, size_t>& b) {
+        return a.first < b.first;
+    }, parallelism);
+
+    index.clear();
+    for (auto& entry : entries) {
+        // Sorted input: a key either equals the last one or goes after it
+        if (!index.empty() && !(std::prev(index.end())->first < entry.first)) {
+            std::prev(index.end())->second.push_back(entry.second);
+        } else {
+            index.emplace_hint(index.end(), std::move(entry.first), std::vector<size_t>{entry.second});
+        }
+    }
+}
+
+inline TableStatistics TableStatistics::collect(const std::vector<Row>& rows, size_t columnCount, size_t parallelism) {
+    TableStatistics stats;
+    stats.rowCount = rows.size();
+    stats.columns.resize(columnCount);
+
+    // Counts, ranges and sketches from every row, chunk by chunk
+    size_t chunks = std::max<size_t>(std::min(parallelism, (rows.size() + COLLECT_CHUNK - 1) / COLLECT_CHUNK), 1);
+    std::vector<std::vector<ColumnStatistics>> partial(chunks, std::vector<ColumnStatistics>(columnCount));
+    ThreadPool::shared().parallelFor(chunks, [&](size_t chunk) {
+        size_t first = rows.size() * chunk / chunks;
+        size_t last = rows.size() * (chunk + 1) / chunks;
+        for (size_t i = first; i < last; i++) {
+            addValues(partial[chunk], rows[i]);
+        }
+    });
+    for (const auto& part : partial) {
+        for (size_t col = 0; col < columnCount; col++) {
+            ColumnStatistics& column = stats.columns[col];
+            const ColumnStatistics& other = part[col];
+            column.sketch.merge(other.sketch);
+            column.emptyCount += other.emptyCount;
+            if (other.hasRange) {
+                extendRange(column, other.min);
+                extendRange(column, other.max);
+            }
+        }
+    }
+
+    // Rows are sampled at random rather than evenly spaced, which could
+    // line up with periodic data; the fixed seed keeps plans repeatable
+    std::vector<size_t> sampleRows;
+    if (rows.size() <= SAMPLE_ROWS) {
+        for (size_t i = 0; i < rows.size(); i++) sampleRows.push_back(i);
+    } else {
+        std::mt19937_64 random(rows.size());
+        std::uniform_int_distribution<size_t> pick(0, rows.size() - 1);
+        for (size_t i = 0; i < SAMPLE_ROWS; i++) sampleRows.push_back(pick(random));
+        std::sort(sampleRows.begin(), sampleRows.end());
+    }
+    size_t sampleSize = sampleRows.size();
+    std::vector<const Value*> sample;
+    for (size_t col = 0; col < columnCount; col++) {
+        ColumnStatistics& column = stats.columns[col];
+        column.distinctCount = std::min(column.sketch.estimate(),
+                                        static_cast<double>(rows.size() - column.emptyCount));
+
+        sample.clear();
+        for (size_t i : sampleRows) {
+            if (!isEmptyValue(rows[i][col])) sample.push_back(&rows[i][col]);
+        }
+        std::sort(sample.begin(), sample.end(),
+                  [](const Value* a, const Value* b) { return compareForSort(*a, *b) < 0; });
+        summarizeSample(column, sample, sampleSize);
+    }
+    return stats;
+}
+
+inline std::shared_ptr<const TableStatistics> Table::collectStatistics() const {
+    auto fresh = std::make_shared<TableStatistics>(
+        TableStatistics::collect(rows, columns.size(), ThreadPool::shared().getWorkerCount()));
+
+    std::lock_guard<std::mutex> guard(statisticsMutex);
+    statistics = fresh;
+    statisticsModifications = modifications;
+    return statistics;
+}
+
+inline void Table::rebuildIndexes() {
+    for (auto& pair : indexes) {
+        size_t colIndex = columnMap[pair.first];
+        std::vector<std::pair<Value, size_t>> entries;
+        entries.reserve(rows.size());
+        for (size_t i = 0; i < rows.size(); i++) {
+            entries.emplace_back(rows[i][colIndex], i);
+        }
+        pair.second->bulkLoad(std::move(entries), ThreadPool::shared().getWorkerCount());
+    }
+}
+
+inline void SortOperator::sortBuffer() {
+    parallelStableSort(sorted, [](const Entry& a, const Entry& b) {
+        return a.key < b.key;
+    }, context.parallelism);
+}
+
+// Aggregation
+
+enum class AggregateFunction {
+    NONE,
+    COUNT,
+    SUM,
+    AVG,
+    MIN,
+    MAX
+};
+
+// Running state of one aggregate for one group. Only the fields matching the
+// aggregate and its input type are used, so updates never build a Value.
+struct AggregateState {
+    int64_t count = 0;
+    int64_t intValue = 0;
+    double realValue = 0;
+    std::string textValue;
+    bool hasValue = false;
+};
+
+typedef void (*AggregateUpdate)(AggregateState&, const Value&);
+
+// Update functions, one per aggregate and input type. Values whose type does
+// not match the column's declared type are ignored by everything but COUNT.
+static void updateCount(AggregateState& state, const Value&) {
+    state.count++;
+}
+
+static void updateSumInt(AggregateState& state, const Value& value) {
+    if (const int* v = std::get_if<int>(&value.data)) {
+        state.intValue += *v;
+        state.count++;
+    }
+}
+
+// REAL columns store integers as REAL (Table::toColumnType); an INTEGER
+// value that got there some other way still counts as a number
+static bool realInput(const Value& value, double& number) {
+    if (const double* v = std::get_if<double>(&value.data)) {
+        number = *v;
+        return true;
+    }
+    if (const int* v = std::get_if<int>(&value.data)) {
+        number = *v;
+        return true;
+    }
+    return false;
+}
+
+static void updateSumReal(AggregateState& state, const Value& value) {
+    double v;
+    if (realInput(value, v)) {
+        state.realValue += v;
+        state.count++;
+    }
+}
+
+template <bool IsMin>
+static void updateExtremeInt(AggregateState& state, const Value& value) {
+    const int* v = std::get_if<int>(&value.data);
+    if (v && (!state.hasValue || (IsMin ? *v < state.intValue : *v > state.intValue))) {
+        state.intValue = *v;
+        state.hasValue = true;
+    }
+}
+
+template <bool IsMin>
+static void updateExtremeBool(AggregateState& state, const Value& value) {
+    const bool* v = std::get_if<bool>(&value.data);
+    if (v && (!state.hasValue || (IsMin ? *v < state.intValue : *v > state.intValue))) {
+        state.intValue = *v;
+        state.hasValue = true;
+    }
+}
+
+template <bool IsMin>
+static void updateExtremeReal(AggregateState& state, const Value& value) {
+    double v;
+    if (realInput(value, v) && (!state.hasValue || (IsMin ? v < state.realValue : v > state.realValue))) {
+        state.realValue = v;
+        state.hasValue = true;
+    }
+}
+
+template <bool IsMin>
+static void updateExtremeText(AggregateState& state, const Value& value) {
+    const std::string* v = std::get_if<std::string>(&value.data);
+    if (v && (!state.hasValue || (IsMin ? *v < state.textValue : *v > state.textValue))) {
+        state.textValue = *v;
+        state.hasValue = true;
+    }
+}
+
+// One aggregate in a query, resolved against the input schema
+struct AggregateSpec {
+    AggregateFunction function;
+    int column;          // input column, -1 for COUNT(*)
+    DataType inputType;  // declared type of the input column
+    AggregateUpdate update;
+
+    // Picks the typed update function; returns false if the function does
+    // not apply to the input type (SUM and AVG need numbers)
+    static bool create(AggregateFunction function, int column, DataType inputType, AggregateSpec& spec) {
+        spec = {function, column, inputType, nullptr};
+        bool integer = inputType == DataType::INTEGER;
+        switch (function) {
+            case AggregateFunction::COUNT:
+                spec.update = updateCount;
+                return true;
+            case AggregateFunction::SUM:
+            case AggregateFunction::AVG:
+                if (integer) spec.update = updateSumInt;
+                else if (inputType == DataType::REAL) spec.update = updateSumReal;
+                return spec.update != nullptr;
+            case AggregateFunction::MIN:
+            case AggregateFunction::MAX: {
+                bool isMin = function == AggregateFunction::MIN;
+                switch (inputType) {
+                    case DataType::INTEGER: spec.update = isMin ? updateExtremeInt<true> : updateExtremeInt<false>; break;
+                    case DataType::REAL: spec.update = isMin ? updateExtremeReal<true> : updateExtremeReal<false>; break;
+                    case DataType::BOOLEAN: spec.update = isMin ? updateExtremeBool<true> : updateExtremeBool<false>; break;
+                    case DataType::TEXT: spec.update = isMin ? updateExtremeText<true> : updateExtremeText<false>; break;
+                }
+                return true;
+            }
+            case AggregateFunction::NONE:
+                break;
+        }
+        return false;
+    }
+
+    // Folds a partial state for the same group into another, as if all of
+    // the partial state's inputs had been applied to it
+    void merge(AggregateState& into, const AggregateState& from) const {
+        if (function != AggregateFunction::MIN && function != AggregateFunction::MAX) {
+            into.count += from.count;
+            into.intValue += from.intValue;
+            into.realValue += from.realValue;
+            return;
+        }
+        if (!from.hasValue) return;
+
+        bool isMin = function == AggregateFunction::MIN;
+        bool take = !into.hasValue;
+        if (!take) {
+            switch (inputType) {
+                case DataType::TEXT: take = isMin ? from.textValue < into.textValue : from.textValue > into.textValue; break;
+                case DataType::REAL: take = isMin ? from.realValue < into.realValue : from.realValue > into.realValue; break;
+                default: take = isMin ? from.intValue < into.intValue : from.intValue > into.intValue; break;
+            }
+        }
+        if (take) into = from;
+    }
+
+    DataType resultType() const {
+        switch (function) {
+            case AggregateFunction::COUNT: return DataType::INTEGER;
+            case AggregateFunction::AVG: return DataType::REAL;
+            default: return inputType;
+        }
+    }
+
+    // Final value of the aggregate. Without any input values there is no
+    // result, which shows as an empty value since the engine has no NULL.
+    Value result(const AggregateState& state) const {
+        if (function == AggregateFunction::COUNT) {
+            return Value(static_cast<int>(state.count));
+        }
+        bool empty = (function == AggregateFunction::SUM || function == AggregateFunction::AVG)
+                         ? state.count == 0 : !state.hasValue;
+        if (empty) {
+            return Value(std::string());
+        }
+
+        bool integer = inputType == DataType::INTEGER;
+        switch (function) {
+            case AggregateFunction::SUM:
+                if (!integer) return Value(state.realValue);
+                // Sums that no longer fit an INTEGER are returned as REAL
+                if (state.intValue >= INT32_MIN && state.intValue <= INT32_MAX) {
+                    return Value(static_cast<int>(state.intValue));
+                }
+                return Value(static_cast<double>(state.intValue));
+            case AggregateFunction::AVG:
+                return Value((integer ? static_cast<double>(state.intValue) : state.realValue) / state.count);
+            default:
+                switch (inputType) {
+                    case DataType::INTEGER: return Value(static_cast<int>(state.intValue));
+                    case DataType::REAL: return Value(state.realValue);
+                    case DataType::BOOLEAN: return Value(state.intValue != 0);
+                    case DataType::TEXT: return Value(state.textValue);
+                }
+        }
+        return Value(std::string());
+    }
+};
+
+// Hash table from group keys to dense group numbers. Keys are stored side
+// by side in one array and chained through flat bucket and link arrays; the
+// table doubles its bucket count when it gets half full.
+class GroupTable {
+private:
+    static constexpr uint32_t NO_GROUP = UINT32_MAX;
+
+    size_t keyWidth;
+    std::vector<Value> keys;
+    std::vector<uint64_t> hashes;
+    std::vector<uint32_t> buckets;
+    std::vector<uint32_t> chain;
+    size_t mask = 15;
+
+    void grow() {
+        buckets.assign(buckets.size() * 2, NO_GROUP);
+        mask = buckets.size() - 1;
+        for (size_t g = 0; g < hashes.size(); g++) {
+            chain[g] = buckets[hashes[g] & mask];
+            buckets[hashes[g] & mask] = static_cast<uint32_t>(g);
+        }
+    }
+
+public:
+    GroupTable(size_t width) : keyWidth(width), buckets(16, NO_GROUP) {}
+
+    static uint64_t hashKey(const Row& row, const std::vector<size_t>& keyColumns) {
+        uint64_t h = 0x84222325cbf29ce4ULL;
+        for (size_t column : keyColumns) {
+            h = (h ^ hashValue(row[column])) * 0x100000001b3ULL;
+        }
+        return h;
+    }
+
+    static uint64_t hashKey(const Value* key, size_t width) {
+        uint64_t h = 0x84222325cbf29ce4ULL;
+        for (size_t i = 0; i < width; i++) {
+            h = (h ^ hashValue(key[i])) * 0x100000001b3ULL;
+        }
+        return h;
+    }
+
+    // Returns the group number for the key columns of a row, adding a new
+    // group if the key has not been seen before
+    size_t findOrInsert(const Row& row, const std::vector<size_t>& keyColumns, uint64_t hash) {
+        return findOrInsert([&](size_t i) -> const Value& { return row[keyColumns[i]]; }, hash);
+    }
+
+    size_t findOrInsert(const Value* key, uint64_t hash) {
+        return findOrInsert([key](size_t i) -> const Value& { return key[i]; }, hash);
+    }
+
+    template <typename KeyAt>
+    size_t findOrInsert(KeyAt keyAt, uint64_t hash) {
+        for (uint32_t g = buckets[hash & mask]; g != NO_GROUP; g = chain[g]) {
+            if (hashes[g] != hash) continue;
+            const Value* key = keys.data() + g * keyWidth; // keys is empty without GROUP BY
+            bool equal = true;
+            for (size_t i = 0; i < keyWidth && equal; i++) {
+                equal = key[i] == keyAt(i);
+            }
+            if (equal) return g;
+        }
+
+        size_t group = hashes.size();
+        for (size_t i = 0; i < keyWidth; i++) {
+            keys.push_back(keyAt(i));
+        }
+        hashes.push_back(hash);
+        chain.push_back(buckets[hash & mask]);
+        buckets[hash & mask] = static_cast<uint32_t>(group);
+        if (hashes.size() * 2 > buckets.size()) grow();
+        return group;
+    }
+
+    size_t size() const {
+        return hashes.size();
+    }
+
+    const Value* key(size_t group) const {
+        return keys.data() + group * keyWidth;
+    }
+
+    uint64_t hash(size_t group) const {
+        return hashes[group];
+    }
+};
+
+// "keys: a, b; aggregates: COUNT(*)" for an aggregation's output schema,
+// which holds keyCount key columns followed by the aggregates
+static std::string describeAggregation(const std::vector<Column>& schema, size_t keyCount) {
+    std::string text;
+    for (size_t i = 0; i < schema.size(); i++) {
+        if (i == 0 && keyCount > 0) text += "keys: ";
+        if (i == keyCount) text += keyCount > 0 ? "; aggregates: " : "aggregates: ";
+        else if (i > 0) text += ", ";
+        text += schema[i].name;
+    }
+    return text;
+}
+
+// Groups its input on the key columns and computes aggregates per group.
+// Output rows hold the key columns followed by one column per aggregate.
+// Without key columns all input forms a single group, which is produced
+// even when the input is empty.
+class HashAggregateOperator : public Operator {
+private:
+    std::unique_ptr<Operator> child;
+    std::vector<size_t> keyColumns;
+    std::vector<AggregateSpec> aggregates;
+    std::vector<Column> schema;
+
+    GroupTable groups;
+    std::vector<AggregateState> states; // aggregates.size() per group
+    size_t position = 0;
+    Row buffer;
+
+public:
+    HashAggregateOperator(std::unique_ptr<Operator> c, const std::vector<size_t>& keys,
+                          const std::vector<AggregateSpec>& specs, const std::vector<Column>& outputSchema)
+        : child(std::move(c)), keyColumns(keys), aggregates(specs), schema(outputSchema),
+          groups(keys.size()), buffer(std::vector<Value>()) {}
+
+    void open() override {
+        child->open();
+        groups = GroupTable(keyColumns.size());
+        states.clear();
+        position = 0;
+
+        const Row* row;
+        while (child->next(row)) {
+            size_t group = groups.findOrInsert(*row, keyColumns, GroupTable::hashKey(*row, keyColumns));
+            if (states.size() < (group + 1) * aggregates.size()) {
+                states.resize((group + 1) * aggregates.size());
+            }
+            AggregateState* groupStates = states.data() + group * aggregates.size();
+            for (size_t a = 0; a < aggregates.size(); a++) {
+                const AggregateSpec& spec = aggregates[a];
+                spec.update(groupStates[a], spec.column >= 0 ? (*row)[spec.column] : (*row)[0]);
+            }
+        }
+
+        if (keyColumns.empty() && groups.size() == 0) {
+            states.resize(aggregates.size());
+        }
+    }
+
+    bool next(const Row*& row) override {
+        size_t groupCount = keyColumns.empty() ? 1 : groups.size();
+        if (position >= groupCount) return false;
+
+        buffer.values.clear();
+        if (!keyColumns.empty()) {
+            const Value* key = groups.key(position);
+            buffer.values.insert(buffer.values.end(), key, key + keyColumns.size());
+        }
+        const AggregateState* groupStates = states.data() + position * aggregates.size();
+        for (size_t a = 0; a < aggregates.size(); a++) {
+            buffer.values.push_back(aggregates[a].result(groupStates[a]));
+        }
+        position++;
+        row = &buffer;
+        return true;
+    }
+
+    void close() override {
+        child->close();
+        groups = GroupTable(keyColumns.size());
+        states = std::vector<AggregateState>();
+    }
+
+    std::string describe() const override {
+        return "HashAggregate " + describeAggregation(schema, keyColumns.size());
+    }
+
+    std::vector<std::unique_ptr<Operator>*> inputs() override {
+        return {&child};
+    }
+
+    const std::vector<Column>& getSchema() const override {
+        return schema;
+    }
+};
+
+// Rows of a table handed to one worker at a time by parallel operators
+static constexpr size_t MORSEL_SIZE = 16384;
+
+// Parallel GROUP BY over a table. Up to parallelism pool tasks claim morsels
+// of rows, filter them and pre-aggregate into task-local tables, split by
+// the top bits of the group hash into radix partitions. Each partition is
+// then merged across tasks by a single task, so no locks are taken on any
+// group table.
+class ParallelHashAggregateOperator : public Operator {
+private:
+    static constexpr size_t PARTITION_BITS = 5;
+    static constexpr size_t PARTITIONS = size_t(1) << PARTITION_BITS;
+
+    struct Partition {
+        GroupTable groups;
+        std::vector<AggregateState> states; // aggregates.size() per group
+
+        Partition(size_t keyWidth) : groups(keyWidth) {}
+    };
+
+    const Table& table;
+    std::function<bool(const Row&)> filter; // null to aggregate every row
+    std::string filterDescription;
+    std::vector<size_t> keyColumns;
+    std::vector<AggregateSpec> aggregates;
+    std::vector<Column> schema;
+    size_t parallelism;
+
+    std::vector<Partition> merged;
+    size_t partition = 0;
+    size_t position = 0;
+    bool emitEmptyGroup = false;
+    Row buffer;
+
+    static size_t partitionOf(uint64_t hash) {
+        return hash >> (64 - PARTITION_BITS);
+    }
+
+    AggregateState* addGroup(Partition& part, size_t group) {
+        if (part.states.size() < (group + 1) * aggregates.size()) {
+            part.states.resize((group + 1) * aggregates.size());
+        }
+        return part.states.data() + group * aggregates.size();
+    }
+
+    void aggregateMorsels(std::vector<Partition>& local, std::atomic<size_t>& nextMorsel) {
+        size_t rowCount = table.getRowCount();
+        while (true) {
+            size_t first = nextMorsel.fetch_add(1) * MORSEL_SIZE;
+            if (first >= rowCount) return;
+            size_t last = std::min(first + MORSEL_SIZE, rowCount);
+
+            for (size_t i = first; i < last; i++) {
+                const Row& row = table.getRow(i);
+                if (filter && !filter(row)) continue;
+
+                uint64_t hash = GroupTable::hashKey(row, keyColumns);
+                Partition& part = local[partitionOf(hash)];
+                AggregateState* states = addGroup(part, part.groups.findOrInsert(row, keyColumns, hash));
+                for (size_t a = 0; a < aggregates.size(); a++) {
+                    const AggregateSpec& spec = aggregates[a];
+                    spec.update(states[a], spec.column >= 0 ? row[spec.column] : row[0]);
+                }
+            }
+        }
+    }
+
+    void mergePartitions(std::vector<std::vector<Partition>>& local, std::atomic<size_t>& nextPartition) {
+        while (true) {
+            size_t p = nextPartition.fetch_add(1);
+            if (p >= PARTITIONS) return;
+
+            Partition& target = merged[p];
+            for (auto& worker : local) {
+                Partition& source = worker[p];
+                for (size_t g = 0; g < source.groups.size(); g++) {
+                    AggregateState* states =
+                        addGroup(target, target.groups.findOrInsert(source.groups.key(g), source.groups.hash(g)));
+                    for (size_t a = 0; a < aggregates.size(); a++) {
+                        aggregates[a].merge(states[a], source.states[g * aggregates.size() + a]);
+                    }
+                }
+                source = Partition(keyColumns.size());
+            }
+        }
+    }
+
+public:
+    ParallelHashAggregateOperator(const Table& t, std::function<bool(const Row&)> f,
+                                  const std::vector<size_t>& keys, const std::vector<AggregateSpec>& specs,
+                                  const std::vector<Column>& outputSchema, size_t threads,
+                                  const std::string& filterText = "")
+        : table(t), filter(std::move(f)), filterDescription(filterText), keyColumns(keys), aggregates(specs),
+          schema(outputSchema), parallelism(std::max<size_t>(threads, 1)), buffer(std::vector<Value>()) {}
+
+    void open() override {
+        size_t morsels = (table.getRowCount() + MORSEL_SIZE - 1) / MORSEL_SIZE;
+        size_t workers = std::max<size_t>(std::min(parallelism, morsels), 1);
+
+        std::vector<std::vector<Partition>> local(workers, std::vector<Partition>(PARTITIONS, Partition(keyColumns.size())));
+        std::atomic<size_t> nextMorsel{0};
+        ThreadPool::shared().parallelFor(workers, [&](size_t w) { aggregateMorsels(local[w], nextMorsel); });
+
+        merged.assign(PARTITIONS, Partition(keyColumns.size()));
+        std::atomic<size_t> nextPartition{0};
+        ThreadPool::shared().parallelFor(std::min(workers, PARTITIONS),
+                                         [&](size_t) { mergePartitions(local, nextPartition); });
+
+        partition = 0;
+        position = 0;
+        emitEmptyGroup = keyColumns.empty();
+        for (const auto& part : merged) {
+            emitEmptyGroup = emitEmptyGroup && part.groups.size() == 0;
+        }
+    }
+
+    bool next(const Row*& row) override {
+        buffer.values.clear();
+        if (emitEmptyGroup) {
+            emitEmptyGroup = false;
+            AggregateState empty;
+            for (const auto& spec : aggregates) {
+                buffer.values.push_back(spec.result(empty));
+            }
+            row = &buffer;
+            return true;
+        }
+
+        while (partition < merged.size() && position >= merged[partition].groups.size()) {
+            partition++;
+            position = 0;
+        }
+        if (partition >= merged.size()) return false;
+
+        const Partition& part = merged[partition];
+        const Value* key = part.groups.key(position);
+        buffer.values.insert(buffer.values.end(), key, key + keyColumns.size());
+        const AggregateState* states = part.states.data() + position * aggregates.size();
+        for (size_t a = 0; a < aggregates.size(); a++) {
+            buffer.values.push_back(aggregates[a].result(states[a]));
+        }
+        position++;
+        row = &buffer;
+        return true;
+    }
+
+    void close() override {
+        merged.clear();
+    }
+
+    std::string describe() const override {
+        std::string text = "ParallelHashAggregate " + table.getName() + " (parallelism " +
+                           std::to_string(parallelism) + ") ";
+        if (!filterDescription.empty()) text += "where " + filterDescription + "; ";
+        return text + describeAggregation(schema, keyColumns.size());
+    }
+
+    const std::vector<Column>& getSchema() const override {
+        return schema;
+    }
+};
+
+// Builds the plan for one morsel: the rows [first, last) of a table, filtered.
+// Its rows must point into table storage.
+typedef std::function<std::unique_ptr<Operator>(size_t first, size_t last)> MorselPlan;
+
+// Morsel-driven parallel scan. Each morsel of the table is a pool task that
+// runs the morsel plan over it (so filters are evaluated in parallel) and
+// collects pointers to the qualifying rows; the consuming thread hands them
+// out morsel by morsel, in table order when order must be preserved. Only
+// a couple of morsels per degree of parallelism are in flight at a time, so
+// memory stays bounded and a query that stops early (LIMIT) leaves most of
+// the table unread.
+class ParallelScanOperator : public Operator {
+private:
+    const Table& table;
+    MorselPlan morselPlan;
+    size_t parallelism;
+    bool preserveOrder;
+
+    std::unique_ptr<TaskGroup> tasks;
+    std::mutex mutex;
+    std::map<size_t, std::vector<const Row*>> finished; // morsel number -> qualifying rows
+    std::atomic<bool> stopping{false};
+    size_t morselCount = 0;
+    size_t nextMorsel = 0; // next morsel to submit
+    size_t consumed = 0;   // morsels handed to the consumer so far
+
+    std::vector<const Row*> current;
+    size_t position = 0;
+
+    void scanMorsel(size_t morsel) {
+        if (stopping) return;
+
+        std::vector<const Row*> rows;
+        auto plan = morselPlan(morsel * MORSEL_SIZE, (morsel + 1) * MORSEL_SIZE);
+        const Row* row;
+        plan->open();
+        while (plan->next(row)) {
+            rows.push_back(row);
+        }
+        plan->close();
+
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            finished[morsel] = std::move(rows);
+        }
+        ThreadPool::shared().wakeWaiters();
+    }
+
+    // Keeps 2 * parallelism morsels submitted ahead of the consumer
+    void submitMorsels() {
+        while (nextMorsel < morselCount && nextMorsel < consumed + 2 * parallelism) {
+            size_t morsel = nextMorsel++;
+            tasks->submit([this, morsel] { scanMorsel(morsel); });
+        }
+    }
+
+    bool morselAvailable() const {
+        return preserveOrder ? finished.count(consumed) > 0 : !finished.empty();
+    }
+
+    void stopTasks() {
+        stopping = true;
+        tasks.reset();
+    }
+
+public:
+    ParallelScanOperator(const Table& t, MorselPlan plan, size_t threads, bool ordered)
+        : table(t), morselPlan(std::move(plan)), parallelism(std::max<size_t>(threads, 1)), preserveOrder(ordered) {}
+
+    ~ParallelScanOperator() override {
+        stopTasks();
+    }
+
+    void open() override {
+        stopTasks();
+        stopping = false;
+        tasks = std::make_unique<TaskGroup>();
+        morselCount = (table.getRowCount() + MORSEL_SIZE - 1) / MORSEL_SIZE;
+        nextMorsel = 0;
+        consumed = 0;
+        finished.clear();
+        current.clear();
+        position = 0;
+        submitMorsels();
+    }
+
+    bool next(const Row*& row) override {
+        while (position >= current.size()) {
+            if (consumed >= morselCount) return false;
+            // Run queued tasks (ours or other queries') while waiting; a
+            // morsel that threw is rethrown here by the group
+            ThreadPool& pool = ThreadPool::shared();
+            auto ready = [this] {
+                std::lock_guard<std::mutex> guard(mutex);
+                return morselAvailable();
+            };
+            while (!ready()) {
+                if (tasks->hasFailed()) {
+                    stopping = true;
+                    tasks->wait();
+                }
+                if (pool.runPendingTask()) continue;
+                pool.waitUntil([&] { return ready() || tasks->hasFailed(); });
+            }
+            {
+                std::lock_guard<std::mutex> guard(mutex);
+                auto it = preserveOrder ? finished.find(consumed) : finished.begin();
+                current = std::move(it->second);
+                finished.erase(it);
+                consumed++;
+            }
+            submitMorsels();
+            position = 0;
+        }
+        row = current[position++];
+        return true;
+    }
+
+    void close() override {
+        stopTasks();
+        finished.clear();
+        current = std::vector<const Row*>();
+    }
+
+    // Describes the plan run on each morsel by building it for an empty one
+    std::string describe() const override {
+        std::unique_ptr<Operator> sample = morselPlan(0, 0);
+        return "ParallelScan " + table.getName() + " (parallelism " + std::to_string(parallelism) +
+               ", per morsel: " + describePlan(*sample) + ")";
+    }
+
+    const std::vector<Column>& getSchema() const override {
+        return table.getColumns();
+    }
+
+    bool producesStableRows() const override {
+        return true;
+    }
+};
+
+// Vectorized (batch-at-a-time) execution
+//
+// Batch operators exchange up to BATCH_SIZE consecutive table rows at a time.
+// The columns a plan needs are unpacked from their Value variants into typed
+// arrays once per batch, and predicates run as tight loops over those arrays
+// that narrow a selection vector of qualifying positions.
+const size_t BATCH_SIZE = 1024;
+
+// Filtered scans over tables with at least this many rows are vectorized
+const size_t VECTORIZED_SCAN_THRESHOLD = 4 * BATCH_SIZE;
+
+// One column of a batch, unpacked into the array matching its declared type
+struct ColumnVector {
+    size_t columnIndex = 0;
+    DataType type = DataType::INTEGER;
+    std::vector<int> ints;
+    std::vector<double> reals;
+    std::vector<uint8_t> bools;
+    std::vector<std::string_view> texts;
+    // 1 where the stored value has the declared type. Other values never
+    // compare equal to (or ordered against) a literal of the declared type.
+    std::vector<uint8_t> valid;
+};
+
+struct Batch {
+    size_t firstRow = 0;
+    size_t size = 0;
+    std::vector<ColumnVector> columns;
+    std::vector<uint32_t> selection;
+    size_t selectedCount = 0;
+};
+
+class BatchOperator {
+public:
+    virtual ~BatchOperator() = default;
+
+    virtual void open() = 0;
+    virtual bool nextBatch(Batch& batch) = 0;
+    virtual void close() = 0;
+
+    // The pipeline up to this operator, for EXPLAIN
+    virtual std::string describe() const = 0;
+
+    // The table column unpacked into a batch column slot
+    virtual const Column& slotColumn(size_t slot) const = 0;
+};
+
+// Reads a table in batches, unpacking only the requested columns
+class BatchScanOperator : public BatchOperator {
+private:
+    const Table& table;
+    std::vector<size_t> columnIndexes;
+    size_t first;
+    size_t last;
+    size_t position = 0;
+
+    template <typename T>
+    static void unpack(const Table& table, size_t first, size_t count, size_t colIndex,
+                       std::vector<T>& out, std::vector<uint8_t>& valid) {
+        out.resize(count);
+        valid.resize(count);
+        for (size_t i = 0; i < count; i++) {
+            const auto* val = std::get_if<T>(&table.getRow(first + i)[colIndex].data);
+            valid[i] = val != nullptr;
+            out[i] = val ? *val : T();
+        }
+    }
+
+public:
+    // Scans the rows [firstRow, lastRow), by default the whole table
+    BatchScanOperator(const Table& t, const std::vector<size_t>& columns, size_t firstRow = 0,
+                      size_t lastRow = SIZE_MAX)
+        : table(t), columnIndexes(columns), first(firstRow), last(lastRow) {}
+
+    std::string describe() const override {
+        return "VectorizedScan " + table.getName();
+    }
+
+    const Column& slotColumn(size_t slot) const override {
+        return table.getColumns()[columnIndexes[slot]];
+    }
+
+    void open() override {
+        position = first;
+    }
+
+    bool nextBatch(Batch& batch) override {
+        size_t end = std::min(last, table.getRowCount());
+        if (position >= end) return false;
+
+        size_t count = std::min(BATCH_SIZE, end - position);
+        batch.firstRow = position;
+        batch.size = count;
+        batch.columns.resize(columnIndexes.size());
+
+        for (size_t c = 0; c < columnIndexes.size(); c++) {
+            ColumnVector& vec = batch.columns[c];
+            vec.columnIndex = columnIndexes[c];
+            vec.type = table.getColumns()[vec.columnIndex].type;
+
+            switch (vec.type) {
+                case DataType::INTEGER:
+                    unpack(table, position, count, vec.columnIndex, vec.ints, vec.valid);
+                    break;
+                case DataType::REAL:
+                    unpack(table, position, count, vec.columnIndex, vec.reals, vec.valid);
+                    break;
+                case DataType::BOOLEAN: {
+                    vec.bools.resize(count);
+                    vec.valid.resize(count);
+                    for (size_t i = 0; i < count; i++) {
+                        const bool* val = std::get_if<bool>(&table.getRow(position + i)[vec.columnIndex].data);
+                        vec.valid[i] = val != nullptr;
+                        vec.bools[i] = val ? *val : 0;
+                    }
+                    break;
+                }
+                case DataType::TEXT: {
+                    vec.texts.resize(count);
+                    vec.valid.resize(count);
+                    for (size_t i = 0; i < count; i++) {
+                        const auto* val = std::get_if<std::string>(&table.getRow(position + i)[vec.columnIndex].data);
+                        vec.valid[i] = val != nullptr;
+                        vec.texts[i] = val ? std::string_view(*val) : std::string_view();
+                    }
+                    break;
+                }
+            }
+        }
+
+        batch.selection.resize(count);
+        for (size_t i = 0; i < count; i++) {
+            batch.selection[i] = static_cast<uint32_t>(i);
+        }
+        batch.selectedCount = count;
+
+        position += count;
+        return true;
+    }
+
+    void close() override {}
+};
+
+// Filter kernels
+//
+// compare*() evaluate "value <op> literal" over a contiguous array and set
+// bit i of the output mask (64 values per word) when element i matches. Each
+// kernel has a scalar version plus SSE4.1 and AVX2 versions on x86-64; the
+// widest one the CPU supports is picked once at startup.
+typedef void (*IntCompareKernel)(const int*, size_t, CompareOp, int, uint64_t*);
+typedef void (*RealCompareKernel)(const double*, size_t, CompareOp, double, uint64_t*);
+typedef void (*BoolCompareKernel)(const uint8_t*, size_t, CompareOp, uint8_t, uint64_t*);
+
+template <typename T>
+static inline bool compareScalar(T value, CompareOp op, T literal) {
+    switch (op) {
+        case CompareOp::EQ: return value == literal;
+        case CompareOp::NE: return value != literal;
+        case CompareOp::LT: return value < literal;
+        case CompareOp::LE: return value <= literal;
+        case CompareOp::GT: return value > literal;
+        case CompareOp::GE: return value >= literal;
+    }
+    return false;
+}
+
+// Scalar loop over elements [begin, count), also used for SIMD tails
+template <typename T>
+static void compareTail(const T* data, size_t begin, size_t count, CompareOp op, T literal, uint64_t* mask) {
+    for (size_t i = begin; i < count; i++) {
+        mask[i >> 6] |= static_cast<uint64_t>(compareScalar(data[i], op, literal)) << (i & 63);
+    }
+}
+
+template <typename T>
+static void compareScalarKernel(const T* data, size_t count, CompareOp op, T literal, uint64_t* mask) {
+    std::fill(mask, mask + (count + 63) / 64, 0);
+    compareTail(data, 0, count, op, literal, mask);
+}
+
+#ifdef DB_X86_SIMD
+// Integer and boolean comparisons are built from "equal" and "greater than",
+// swapping operands for < and inverting the result for <>, <= and >=
+static inline bool invertsResult(CompareOp op) {
+    return op == CompareOp::NE || op == CompareOp::LE || op == CompareOp::GE;
+}
+
+__attribute__((target("sse4.1")))
+static void compareIntSse41(const int* data, size_t count, CompareOp op, int literal, uint64_t* mask) {
+    std::fill(mask, mask + (count + 63) / 64, 0);
+    const __m128i lit = _mm_set1_epi32(literal);
+    const uint64_t invert = invertsResult(op) ? 0xF : 0;
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i cmp;
+        switch (op) {
+            case CompareOp::EQ: case CompareOp::NE: cmp = _mm_cmpeq_epi32(v, lit); break;
+            case CompareOp::GT: case CompareOp::LE: cmp = _mm_cmpgt_epi32(v, lit); break;
+            default: cmp = _mm_cmpgt_epi32(lit, v); break;
+        }
+        uint64_t bits = static_cast<uint64_t>(_mm_movemask_ps(_mm_castsi128_ps(cmp))) ^ invert;
+        mask[i >> 6] |= bits << (i & 63);
+    }
+    compareTail(data, i, count, op, literal, mask);
+}
+
+__attribute__((target("avx2")))
+static void compareIntAvx2(const int* data, size_t count, CompareOp op, int literal, uint64_t* mask) {
+    std::fill(mask, mask + (count + 63) / 64, 0);
+    const __m256i lit = _mm256_set1_epi32(literal);
+    const uint64_t invert = invertsResult(op) ? 0xFF : 0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i cmp;
+        switch (op) {
+            case CompareOp::EQ: case CompareOp::NE: cmp = _mm256_cmpeq_epi32(v, lit); break;
+            case CompareOp::GT: case CompareOp::LE: cmp = _mm256_cmpgt_epi32(v, lit); break;
+            default: cmp = _mm256_cmpgt_epi32(lit, v); break;
+        }
+        uint64_t bits = static_cast<uint64_t>(_mm256_movemask_ps(_mm256_castsi256_ps(cmp))) ^ invert;
+        mask[i >> 6] |= bits << (i & 63);
+    }
+    compareTail(data, i, count, op, literal, mask);
+}
+
+__attribute__((target("sse4.1")))
+static void compareRealSse41(const double* data, size_t count, CompareOp op, double literal, uint64_t* mask) {
+    std::fill(mask, mask + (count + 63) / 64, 0);
+    const __m128d lit = _mm_set1_pd(literal);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128d v = _mm_loadu_pd(data + i);
+        __m128d cmp;
+        switch (op) {
+            case CompareOp::EQ: cmp = _mm_cmpeq_pd(v, lit); break;
+            case CompareOp::NE: cmp = _mm_cmpneq_pd(v, lit); break;
+            case CompareOp::LT: cmp = _mm_cmplt_pd(v, lit); break;
+            case CompareOp::LE: cmp = _mm_cmple_pd(v, lit); break;
+            case CompareOp::GT: cmp = _mm_cmpgt_pd(v, lit); break;
+            default: cmp = _mm_cmpge_pd(v, lit); break;
+        }
+        mask[i >> 6] |= static_cast<uint64_t>(_mm_movemask_pd(cmp)) << (i & 63);
+    }
+    compareTail(data, i, count, op, literal, mask);
+}
+
+__attribute__((target("avx2")))
+static void compareRealAvx2(const double* data, size_t count, CompareOp op, double literal, uint64_t* mask) {
+    std::fill(mask, mask + (count + 63) / 64, 0);
+    const __m256d lit = _mm256_set1_pd(literal);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d v = _mm256_loadu_pd(data + i);
+        __m256d cmp;
+        switch (op) {
+            case CompareOp::EQ: cmp = _mm256_cmp_pd(v, lit, _CMP_EQ_OQ); break;
+            case CompareOp::NE: cmp = _mm256_cmp_pd(v, lit, _CMP_NEQ_UQ); break;
+            case CompareOp::LT: cmp = _mm256_cmp_pd(v, lit, _CMP_LT_OQ); break;
+            case CompareOp::LE: cmp = _mm256_cmp_pd(v, lit, _CMP_LE_OQ); break;
+            case CompareOp::GT: cmp = _mm256_cmp_pd(v, lit, _CMP_GT_OQ); break;
+            default: cmp = _mm256_cmp_pd(v, lit, _CMP_GE_OQ); break;
+        }
+        mask[i >> 6] |= static_cast<uint64_t>(_mm256_movemask_pd(cmp)) << (i & 63);
+    }
+    compareTail(data, i, count, op, literal, mask);
+}
+
+// Booleans are stored as 0/1 bytes, so signed byte comparisons order them
+// the same way as bool does
+__attribute__((target("sse4.1")))
+static void compareBoolSse41(const uint8_t* data, size_t count, CompareOp op, uint8_t literal, uint64_t* mask) {
+    std::fill(mask, mask + (count + 63) / 64, 0);
+    const __m128i lit = _mm_set1_epi8(static_cast<char>(literal));
+    const uint64_t invert = invertsResult(op) ? 0xFFFF : 0;
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i cmp;
+        switch (op) {
+            case CompareOp::EQ: case CompareOp::NE: cmp = _mm_cmpeq_epi8(v, lit); break;
+            case CompareOp::GT: case CompareOp::LE: cmp = _mm_cmpgt_epi8(v, lit); break;
+            default: cmp = _mm_cmpgt_epi8(lit, v); break;
+        }
+        uint64_t bits = (static_cast<uint64_t>(_mm_movemask_epi8(cmp)) & 0xFFFF) ^ invert;
+        mask[i >> 6] |= bits << (i & 63);
+    }
+    compareTail(data, i, count, op, literal, mask);
+}
+
+__attribute__((target("avx2")))
+static void compareBoolAvx2(const uint8_t* data, size_t count, CompareOp op, uint8_t literal, uint64_t* mask) {
+    std::fill(mask, mask + (count + 63) / 64, 0);
+    const __m256i lit = _mm256_set1_epi8(static_cast<char>(literal));
+    const uint64_t invert = invertsResult(op) ? 0xFFFFFFFFull : 0;
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i cmp;
+        switch (op) {
+            case CompareOp::EQ: case CompareOp::NE: cmp = _mm256_cmpeq_epi8(v, lit); break;
+            case CompareOp::GT: case CompareOp::LE: cmp = _mm256_cmpgt_epi8(v, lit); break;
+            default: cmp = _mm256_cmpgt_epi8(lit, v); break;
+        }
+        uint64_t bits = static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(cmp))) ^ invert;
+        mask[i >> 6] |= bits << (i & 63);
+    }
+    compareTail(data, i, count, op, literal, mask);
+}
+#endif
+
+struct FilterKernels {
+    IntCompareKernel compareInt;
+    RealCompareKernel compareReal;
+    BoolCompareKernel compareBool;
+    const char* name;
+};
+
+static FilterKernels selectFilterKernels() {
+#ifdef DB_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return {compareIntAvx2, compareRealAvx2, compareBoolAvx2, "avx2"};
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return {compareIntSse41, compareRealSse41, compareBoolSse41, "sse4.1"};
+    }
+#endif
+    return {compareScalarKernel<int>, compareScalarKernel<double>, compareScalarKernel<uint8_t>, "scalar"};
+}
+
+static const FilterKernels& filterKernels() {
+    static const FilterKernels kernels = selectFilterKernels();
+    return kernels;
+}
+
+// Compacts the selection vector in place using a match bitmask. Values of the
+// wrong type only survive for <>.
+static size_t refineSelection(const uint64_t* mask, const uint8_t* valid, uint32_t* selection, size_t count,
+                              bool mismatchResult) {
+    size_t out = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t pos = selection[i];
+        bool bit = (mask[pos >> 6] >> (pos & 63)) & 1;
+        bool keep = valid[pos] ? bit : mismatchResult;
+        selection[out] = pos;
+        out += keep;
+    }
+    return out;
+}
+
+// Compacts the selection vector in place, keeping positions whose value
+// satisfies the comparison. Values of the wrong type only survive for <>.
+template <typename T, typename Compare>
+size_t refineSelection(const T* data, const uint8_t* valid, uint32_t* selection, size_t count,
+                       Compare compare, bool mismatchResult) {
+    size_t out = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t pos = selection[i];
+        bool keep = valid[pos] ? compare(data[pos]) : mismatchResult;
+        selection[out] = pos;
+        out += keep;
+    }
+    return out;
+}
+
+template <typename T>
+size_t refineSelection(const T* data, const uint8_t* valid, uint32_t* selection, size_t count,
+                       CompareOp op, T literal) {
+    switch (op) {
+        case CompareOp::EQ:
+            return refineSelection(data, valid, selection, count, [literal](T v) { return v == literal; }, false);
+        case CompareOp::NE:
+            return refineSelection(data, valid, selection, count, [literal](T v) { return v != literal; }, true);
+        case CompareOp::LT:
+            return refineSelection(data, valid, selection, count, [literal](T v) { return v < literal; }, false);
+        case CompareOp::LE:
+            return refineSelection(data, valid, selection, count, [literal](T v) { return v <= literal; }, false);
+        case CompareOp::GT:
+            return refineSelection(data, valid, selection, count, [literal](T v) { return v > literal; }, false);
+        case CompareOp::GE:
+            return refineSelection(data, valid, selection, count, [literal](T v) { return v >= literal; }, false);
+    }
+    return count;
+}
+
+// Applies "column <op> literal" to the batch column in the given slot. The
+// literal must have the column's declared type.
+class BatchFilterOperator : public BatchOperator {
+private:
+    std::unique_ptr<BatchOperator> child;
+    size_t slot;
+    CompareOp op;
+    Value literal;
+    std::vector<uint64_t> mask;
+
+public:
+    BatchFilterOperator(std::unique_ptr<BatchOperator> c, size_t columnSlot, CompareOp compareOp, const Value& lit)
+        : child(std::move(c)), slot(columnSlot), op(compareOp), literal(lit) {}
+
+    std::string describe() const override {
+        return child->describe() + " [" + slotColumn(slot).name + " " + compareOpSymbol(op) + " " +
+               formatLiteral(literal) + "]";
+    }
+
+    const Column& slotColumn(size_t s) const override {
+        return child->slotColumn(s);
+    }
+
+    void open() override {
+        child->open();
+    }
+
+    bool nextBatch(Batch& batch) override {
+        if (!child->nextBatch(batch)) return false;
+
+        const ColumnVector& vec = batch.columns[slot];
+        uint32_t* selection = batch.selection.data();
+        const uint8_t* valid = vec.valid.data();
+        const FilterKernels& kernels = filterKernels();
+        bool mismatchResult = op == CompareOp::NE;
+        mask.resize((batch.size + 63) / 64);
+
+        switch (vec.type) {
+            case DataType::INTEGER:
+                kernels.compareInt(vec.ints.data(), batch.size, op, std::get<int>(literal.data), mask.data());
+                batch.selectedCount = refineSelection(mask.data(), valid, selection, batch.selectedCount,
+                                                      mismatchResult);
+                break;
+            case DataType::REAL:
+                kernels.compareReal(vec.reals.data(), batch.size, op, std::get<double>(literal.data), mask.data());
+                batch.selectedCount = refineSelection(mask.data(), valid, selection, batch.selectedCount,
+                                                      mismatchResult);
+                break;
+            case DataType::BOOLEAN:
+                kernels.compareBool(vec.bools.data(), batch.size, op,
+                                    static_cast<uint8_t>(std::get<bool>(literal.data)), mask.data());
+                batch.selectedCount = refineSelection(mask.data(), valid, selection, batch.selectedCount,
+                                                      mismatchResult);
+                break;
+            case DataType::TEXT:
+                batch.selectedCount = refineSelection(vec.texts.data(), valid, selection, batch.selectedCount,
+                                                      op, std::string_view(std::get<std::string>(literal.data)));
+                break;
+        }
+        return true;
+    }
+
+    void close() override {
+        child->close();
+    }
+};
+
+// Adapts a batch pipeline over a table back to row-at-a-time iteration
+class BatchToRowOperator : public Operator {
+private:
+    const Table& table;
+    std::unique_ptr<BatchOperator> child;
+    Batch batch;
+    size_t position = 0;
+
+public:
+    BatchToRowOperator(const Table& t, std::unique_ptr<BatchOperator> c) : table(t), child(std::move(c)) {}
+
+    void open() override {
+        batch.selectedCount = 0;
+        position = 0;
+        child->open();
+    }
+
+    bool next(const Row*& row) override {
+        while (position >= batch.selectedCount) {
+            if (!child->nextBatch(batch)) return false;
+            position = 0;
+        }
+        row = &table.getRow(batch.firstRow + batch.selection[position++]);
+        return true;
+    }
+
+    void close() override {
+        child->close();
+    }
+
+    std::string describe() const override {
+        return child->describe();
+    }
+
+    const std::vector<Column>& getSchema() const override {
+        return table.getColumns();
+    }
+
+    bool producesStableRows() const override {
+        return true;
+    }
+};
+
+// Compares two values. Values of different types are never equal or ordered,
+// so only <> holds between them.
+static bool compareValues(const Value& value, CompareOp op, const Value& literal) {
+    if (value.type != literal.type) return op == CompareOp::NE;
+    return compareScalar(value.data, op, literal.data);
+}
+
+// Boolean condition from a WHERE clause
+struct Predicate {
+    enum class Kind {
+        COMPARE, // column <op> literal
+        AND,
+        OR,
+        NOT
+    };
+
+    Kind kind = Kind::COMPARE;
+    std::string column;
+    int columnIndex = -1; // resolved by QueryPlanner::bindPredicate
+    CompareOp op = CompareOp::EQ;
+    Value literal{0};
+    std::vector<std::shared_ptr<Predicate>> children;
+
+    // AND and OR stop evaluating children as soon as the outcome is known
+    bool matches(const Row& row) const {
+        switch (kind) {
+            case Kind::COMPARE:
+                return compareValues(row[columnIndex], op, literal);
+            case Kind::AND:
+                for (const auto& child : children) {
+                    if (!child->matches(row)) return false;
+                }
+                return true;
+            case Kind::OR:
+                for (const auto& child : children) {
+                    if (child->matches(row)) return true;
+                }
+                return false;
+            case Kind::NOT:
+                return !children[0]->matches(row);
+        }
+        return false;
+    }
+
+    // The condition as SQL text, for EXPLAIN
+    std::string toString() const {
+        if (kind == Kind::COMPARE) {
+            return column + " " + compareOpSymbol(op) + " " + formatLiteral(literal);
+        }
+        std::vector<std::string> parts;
+        for (const auto& child : children) {
+            std::string text = child->toString();
+            parts.push_back(child->kind == Kind::COMPARE || child->kind == Kind::NOT ? text : "(" + text + ")");
+        }
+        if (kind == Kind::NOT) return "NOT " + parts[0];
+
+        std::string text;
+        for (size_t i = 0; i < parts.size(); i++) {
+            text += (i > 0 ? (kind == Kind::AND ? " AND " : " OR ") : "") + parts[i];
+        }
+        return text;
+    }
+};
+
+// Table named in a FROM clause. Columns can be qualified with the alias,
+// which defaults to the table name.
+struct TableRef {
+    std::string name;
+    std::string alias;
+};
+
+// "JOIN <table> ON <leftColumn> = <rightColumn>"
+struct JoinClause {
+    TableRef table;
+    std::string leftColumn;
+    std::string rightColumn;
+};
+
+// One entry of a select list: a column or an aggregate over a column
+struct SelectItem {
+    AggregateFunction function = AggregateFunction::NONE;
+    std::string column; // empty for COUNT(*)
+
+    // Column heading for the result
+    std::string label() const {
+        static const char* const names[] = {"", "COUNT", "SUM", "AVG", "MIN", "MAX"};
+        if (function == AggregateFunction::NONE) return column;
+        return std::string(names[static_cast<int>(function)]) + "(" + (column.empty() ? "*" : column) + ")";
+    }
+};
+
+// "ORDER BY <item> [ASC|DESC]"
+struct OrderItem {
+    SelectItem item;
+    bool descending = false;
+};
+
+// Parsed SELECT statement
+struct SelectQuery {
+    TableRef from;
+    std::vector<JoinClause> joins;
+    std::vector<SelectItem> columns;  // empty for SELECT *
+    std::shared_ptr<Predicate> where; // null without a WHERE clause
+    std::vector<std::string> groupBy;
+    std::vector<OrderItem> orderBy;
+    bool hasLimit = false;
+    size_t limit = 0;
+    size_t offset = 0;
+};
+
+// Builds operator trees for parsed queries
+class QueryPlanner {
+private:
+    // Selectivity assumed for a condition the planner cannot measure, and
+    // for an equality on a table without statistics
+    static constexpr double DEFAULT_SELECTIVITY = 1.0 / 3.0;
+    static constexpr double DEFAULT_EQUAL_SELECTIVITY = 0.005;
+
+    // A planned input of a query with the planner's estimates of its size
+    // and of the cost of producing it, in sequentially scanned rows
+    struct PlannedInput {
+        std::unique_ptr<Operator> plan;
+        double estimatedRows = 0;
+        double cost = 0;
+        bool indexed = false; // reads through an index rather than scanning
+    };
+
+    // A table in the FROM clause and where its columns start in the
+    // concatenated schema of all FROM tables
+    struct FromTable {
+        const Table* table;
+        std::string qualifier;
+        size_t offset;
+        std::vector<const Predicate*> conjuncts; // WHERE conditions on this table alone
+    };
+
+    static bool canVectorize(const Table& table, const Predicate& conjunct) {
+        return conjunct.kind == Predicate::Kind::COMPARE &&
+               table.getColumns()[conjunct.columnIndex].type == conjunct.literal.type;
+    }
+
+    static bool isIdentityProjection(const std::vector<size_t>& projection, size_t columnCount) {
+        if (projection.size() != columnCount) return false;
+        for (size_t i = 0; i < projection.size(); i++) {
+            if (projection[i] != i) return false;
+        }
+        return true;
+    }
+
+    // Splits nested ANDs into a flat list of conditions that must all hold
+    static void collectConjuncts(const std::shared_ptr<Predicate>& pred, std::vector<Predicate*>& conjuncts) {
+        if (pred->kind == Predicate::Kind::AND) {
+            for (const auto& child : pred->children) {
+                collectConjuncts(child, conjuncts);
+            }
+        } else {
+            conjuncts.push_back(pred.get());
+        }
+    }
+
+    static void collectColumnNames(const Predicate& pred, std::vector<std::string>& names) {
+        if (pred.kind == Predicate::Kind::COMPARE) {
+            names.push_back(pred.column);
+        }
+        for (const auto& child : pred.children) {
+            collectColumnNames(*child, names);
+        }
+    }
+
+    static bool isIndexable(const Table& table, const Predicate& conjunct) {
+        if (conjunct.kind != Predicate::Kind::COMPARE || conjunct.columnIndex < 0) return false;
+        const Column& column = table.getColumns()[conjunct.columnIndex];
+        return conjunct.op != CompareOp::NE && table.getIndex(column.name) != nullptr &&
+               column.type == conjunct.literal.type;
+    }
+
+    // Narrows a key range with one comparison, keeping the tighter bound
+    static void tightenRange(KeyRange& range, const Predicate& conjunct) {
+        const Value& key = conjunct.literal;
+        bool inclusive = conjunct.op == CompareOp::GE || conjunct.op == CompareOp::LE ||
+                         conjunct.op == CompareOp::EQ;
+
+        if (conjunct.op != CompareOp::LT && conjunct.op != CompareOp::LE) {
+            if (!range.hasLower || range.lower < key || (range.lower == key && !inclusive)) {
+                range.hasLower = true;
+                range.lower = key;
+                range.lowerInclusive = inclusive;
+            }
+        }
+        if (conjunct.op != CompareOp::GT && conjunct.op != CompareOp::GE) {
+            if (!range.hasUpper || key < range.upper || (range.upper == key && !inclusive)) {
+                range.hasUpper = true;
+                range.upper = key;
+                range.upperInclusive = inclusive;
+            }
+        }
+    }
+
+    // Estimated fraction of a table's rows that satisfy a condition bound to
+    // its columns. The children of AND and OR are taken to be independent.
+    // Without statistics (stats is null) the defaults above are assumed.
+    static double estimateSelectivity(const Table& table, const TableStatistics* stats, const Predicate& pred) {
+        switch (pred.kind) {
+            case Predicate::Kind::COMPARE: {
+                size_t column = pred.columnIndex;
+                const Value& key = pred.literal;
+                if (table.getColumns()[column].type != key.type) {
+                    // Values of another type only satisfy <>
+                    return pred.op == CompareOp::NE ? 1 : 0;
+                }
+                if (!stats) {
+                    if (pred.op == CompareOp::EQ) return DEFAULT_EQUAL_SELECTIVITY;
+                    if (pred.op == CompareOp::NE) return 1 - DEFAULT_EQUAL_SELECTIVITY;
+                    return DEFAULT_SELECTIVITY;
+                }
+                switch (pred.op) {
+                    case CompareOp::EQ: return stats->equalFraction(column, key);
+                    case CompareOp::NE: return 1 - stats->equalFraction(column, key);
+                    case CompareOp::LT: return stats->rangeFraction(column, nullptr, false, &key, false);
+                    case CompareOp::LE: return stats->rangeFraction(column, nullptr, false, &key, true);
+                    case CompareOp::GT: return stats->rangeFraction(column, &key, false, nullptr, false);
+                    case CompareOp::GE: return stats->rangeFraction(column, &key, true, nullptr, false);
+                }
+                return DEFAULT_SELECTIVITY;
+            }
+            case Predicate::Kind::AND: {
+                double selectivity = 1;
+                for (const auto& child : pred.children) {
+                    selectivity *= estimateSelectivity(table, stats, *child);
+                }
+                return selectivity;
+            }
+            case Predicate::Kind::OR: {
+                double selectivity = 0;
+                for (const auto& child : pred.children) {
+                    double s = estimateSelectivity(table, stats, *child);
+                    selectivity += s - selectivity * s;
+                }
+                return selectivity;
+            }
+            case Predicate::Kind::NOT:
+                return 1 - estimateSelectivity(table, stats, *pred.children[0]);
+        }
+        return DEFAULT_SELECTIVITY;
+    }
+
+    static double rangeSelectivity(const TableStatistics* stats, size_t column, const KeyRange& range) {
+        if (range.isEmpty()) return 0;
+        if (!stats) {
+            if (range.hasLower && range.hasUpper && range.lower == range.upper) return DEFAULT_EQUAL_SELECTIVITY;
+            return (range.hasLower ? DEFAULT_SELECTIVITY : 1) * (range.hasUpper ? DEFAULT_SELECTIVITY : 1);
+        }
+        return stats->rangeFraction(column, range.hasLower ? &range.lower : nullptr, range.lowerInclusive,
+                                   range.hasUpper ? &range.upper : nullptr, range.upperInclusive);
+    }
+
+    // Estimated fraction of rows satisfying all of the conjuncts. Range
+    // conditions on one column are combined into a single range (id >= 10
+    // AND id < 13) rather than treated as independent.
+    static double conjunctSelectivity(const Table& table, const TableStatistics* stats,
+                                      const std::vector<const Predicate*>& conjuncts) {
+        double selectivity = 1;
+        std::vector<std::pair<size_t, KeyRange>> ranges;
+        for (const Predicate* conjunct : conjuncts) {
+            bool rangeCondition = conjunct->kind == Predicate::Kind::COMPARE && conjunct->op != CompareOp::NE &&
+                                  table.getColumns()[conjunct->columnIndex].type == conjunct->literal.type;
+            if (!rangeCondition) {
+                selectivity *= estimateSelectivity(table, stats, *conjunct);
+                continue;
+            }
+            size_t column = conjunct->columnIndex;
+            auto range = std::find_if(ranges.begin(), ranges.end(),
+                                      [column](const std::pair<size_t, KeyRange>& r) { return r.first == column; });
+            if (range == ranges.end()) {
+                ranges.push_back({column, KeyRange()});
+                range = ranges.end() - 1;
+            }
+            tightenRange(range->second, *conjunct);
+        }
+        for (const auto& range : ranges) {
+            selectivity *= rangeSelectivity(stats, range.first, range.second);
+        }
+        return selectivity;
+    }
+
+    // Picks the cheapest index access path for a table given its WHERE
+    // conjuncts. Every indexed column constrained by the conjuncts is a
+    // candidate; the statistics estimate how many rows its key range holds,
+    // and each of them costs INDEX_ROW_COST against a full scan's one per
+    // table row. Conjuncts answered by the chosen index are marked
+    // consumed, the rest are left for the residual filter. Returns nullptr
+    // if no index beats a scan.
+    static std::unique_ptr<Operator> planIndexAccess(const Table& table, const TableStatistics* stats,
+                                                     const std::vector<const Predicate*>& conjuncts,
+                                                     std::vector<bool>& consumed, double& estimatedRows) {
+        KeyRange range;
+        int column = chooseIndex(table, stats, conjuncts, consumed, estimatedRows, range);
+        if (column < 0) {
+            return nullptr;
+        }
+
+        const BTreeIndex& index = *table.getIndex(table.getColumns()[column].name);
+        bool pointLookup = range.hasLower && range.hasUpper && range.lowerInclusive &&
+                           range.upperInclusive && range.lower == range.upper;
+        if (pointLookup) {
+            return std::make_unique<IndexLookupOperator>(table, index, range.lower);
+        }
+        return std::make_unique<IndexRangeScanOperator>(table, index, range);
+    }
+
+    // The indexed column whose key range among the conjuncts is cheapest to
+    // read, if reading it beats a scan; marks the conjuncts on that column as
+    // consumed and returns the column with its range, or -1
+    static int chooseIndex(const Table& table, const TableStatistics* stats,
+                           const std::vector<const Predicate*>& conjuncts, std::vector<bool>& consumed,
+                           double& estimatedRows, KeyRange& bestRange) {
+        double bestCost = table.getRowCount();
+        int bestColumn = -1;
+
+        for (const Predicate* conjunct : conjuncts) {
+            if (!isIndexable(table, *conjunct) || conjunct->columnIndex == bestColumn) continue;
+
+            KeyRange range;
+            for (const Predicate* other : conjuncts) {
+                if (isIndexable(table, *other) && other->columnIndex == conjunct->columnIndex) {
+                    tightenRange(range, *other);
+                }
+            }
+
+            double rows = rangeSelectivity(stats, conjunct->columnIndex, range) * table.getRowCount();
+            if (rows * INDEX_ROW_COST < bestCost) {
+                bestCost = rows * INDEX_ROW_COST;
+                bestColumn = conjunct->columnIndex;
+                bestRange = range;
+                estimatedRows = rows;
+            }
+        }
+
+        for (size_t i = 0; bestColumn >= 0 && i < conjuncts.size(); i++) {
+            if (isIndexable(table, *conjuncts[i]) && conjuncts[i]->columnIndex == bestColumn) {
+                consumed[i] = true;
+            }
+        }
+        return bestColumn;
+    }
+
+    // Full scan that evaluates the typed comparisons among the conjuncts
+    // batch-at-a-time; returns nullptr if none of them can be vectorized
+    static std::unique_ptr<Operator> planVectorizedScan(const Table& table,
+                                                        const std::vector<const Predicate*>& conjuncts,
+                                                        std::vector<bool>& consumed, size_t firstRow = 0,
+                                                        size_t lastRow = SIZE_MAX) {
+        std::vector<size_t> columns;
+        std::vector<std::pair<size_t, const Predicate*>> filters;
+
+        for (size_t i = 0; i < conjuncts.size(); i++) {
+            if (consumed[i] || !canVectorize(table, *conjuncts[i])) continue;
+
+            size_t colIndex = conjuncts[i]->columnIndex;
+            size_t slot = std::find(columns.begin(), columns.end(), colIndex) - columns.begin();
+            if (slot == columns.size()) {
+                columns.push_back(colIndex);
+            }
+            filters.push_back({slot, conjuncts[i]});
+            consumed[i] = true;
+        }
+
+        if (filters.empty()) {
+            return nullptr;
+        }
+
+        std::unique_ptr<BatchOperator> batches = std::make_unique<BatchScanOperator>(table, columns, firstRow, lastRow);
+        for (const auto& filter : filters) {
+            batches = std::make_unique<BatchFilterOperator>(std::move(batches), filter.first,
+                                                            filter.second->op, filter.second->literal);
+        }
+        return std::make_unique<BatchToRowOperator>(table, std::move(batches));
+    }
+
+    // Checks conditions row by row in the order they were written; empty if
+    // there are none
+    static std::function<bool(const Row&)> residualPredicate(const std::shared_ptr<Predicate>& where,
+                                                             const std::vector<const Predicate*>& residual) {
+        if (residual.empty()) {
+            return nullptr;
+        }
+        return [where, residual](const Row& row) {
+            // where keeps the conjuncts alive
+            for (const Predicate* conjunct : residual) {
+                if (!conjunct->matches(row)) return false;
+            }
+            return true;
+        };
+    }
+
+    static std::string describeConjuncts(const std::vector<const Predicate*>& conjuncts) {
+        std::string text;
+        for (size_t i = 0; i < conjuncts.size(); i++) {
+            text += (i > 0 ? " AND " : "") + conjuncts[i]->toString();
+        }
+        return text;
+    }
+
+    // Filters on conditions the input does not already guarantee
+    static std::unique_ptr<Operator> addResidualFilter(std::unique_ptr<Operator> plan,
+                                                       const std::shared_ptr<Predicate>& where,
+                                                       const std::vector<const Predicate*>& residual) {
+        if (residual.empty()) {
+            return plan;
+        }
+        return std::make_unique<FilterOperator>(std::move(plan), residualPredicate(where, residual),
+                                                describeConjuncts(residual));
+    }
+
+    static const BTreeIndex* columnIndex(const Table& table, size_t column) {
+        return table.getIndex(table.getColumns()[column].name);
+    }
+
+    // Reads a table in the order of the index on one of its columns. WHERE
+    // conditions on that column narrow the index range; the rest are checked
+    // on each row.
+    static std::unique_ptr<Operator> planOrderedAccess(const FromTable& from, size_t column,
+                                                       const std::shared_ptr<Predicate>& where,
+                                                       bool descending = false) {
+        const Table& table = *from.table;
+        KeyRange range;
+        std::vector<const Predicate*> residual;
+        for (const Predicate* conjunct : from.conjuncts) {
+            if (isIndexable(table, *conjunct) && static_cast<size_t>(conjunct->columnIndex) == column) {
+                tightenRange(range, *conjunct);
+            } else {
+                residual.push_back(conjunct);
+            }
+        }
+
+        std::unique_ptr<Operator> plan =
+            std::make_unique<IndexRangeScanOperator>(table, *columnIndex(table, column), range, descending);
+        return addResidualFilter(std::move(plan), where, residual);
+    }
+
+    // Rows an ordered walk of the index on column reads: those in the key
+    // range that the table's conditions put on that column
+    static double orderedAccessRows(const FromTable& from, size_t column) {
+        const Table& table = *from.table;
+        KeyRange range;
+        for (const Predicate* conjunct : from.conjuncts) {
+            if (isIndexable(table, *conjunct) && static_cast<size_t>(conjunct->columnIndex) == column) {
+                tightenRange(range, *conjunct);
+            }
+        }
+        auto stats = table.getStatistics();
+        return rangeSelectivity(stats.get(), column, range) * table.getRowCount();
+    }
+
+    // Input of a merge join: an ordered index scan when the column has an
+    // index, otherwise the planned input sorted on the key
+    static std::unique_ptr<Operator> planSortedInput(std::unique_ptr<Operator> planned, const FromTable* from,
+                                                     size_t key, const std::shared_ptr<Predicate>& where,
+                                                     const ExecutionContext& context) {
+        if (from && columnIndex(*from->table, key)) {
+            return planOrderedAccess(*from, key, where);
+        }
+        return std::make_unique<SortOperator>(std::move(planned), std::vector<SortKey>{{key}}, context);
+    }
+
+    // Rows a filtered scan is expected to read before rowLimit rows pass
+    static double rowsToReach(size_t rowLimit, double selectivity) {
+        return selectivity > 0 ? rowLimit / selectivity : HUGE_VAL;
+    }
+
+    // Filtered scan of the rows [firstRow, lastRow), as planned for each
+    // morsel of a parallel scan
+    static std::unique_ptr<Operator> planFilteredScan(const Table& table,
+                                                      const std::vector<const Predicate*>& conjuncts,
+                                                      const std::shared_ptr<Predicate>& where, size_t firstRow,
+                                                      size_t lastRow) {
+        std::vector<bool> consumed(conjuncts.size(), false);
+        std::unique_ptr<Operator> plan = planVectorizedScan(table, conjuncts, consumed, firstRow, lastRow);
+        if (!plan) {
+            plan = std::make_unique<TableScanOperator>(table, firstRow, lastRow);
+        }
+
+        std::vector<const Predicate*> residual;
+        for (size_t i = 0; i < conjuncts.size(); i++) {
+            if (!consumed[i]) residual.push_back(conjuncts[i]);
+        }
+        return addResidualFilter(std::move(plan), where, residual);
+    }
+
+    // Filtered scans of tables with at least this many rows run in parallel
+    static constexpr size_t PARALLEL_SCAN_THRESHOLD = 2 * MORSEL_SIZE;
+
+    // Access path plus residual filter for one table. The conjuncts must be
+    // bound to the table's columns. rowLimit is how many rows the query can
+    // use at most; a scan expected to stop within its first batch is run row
+    // at a time rather than vectorized, since a batch filters BATCH_SIZE rows
+    // before handing out any. Large filtered scans are split into morsels
+    // filtered by several threads; preserveOrder keeps their output in table
+    // order.
+    static PlannedInput planTableAccess(const Table& table, const std::vector<const Predicate*>& conjuncts,
+                                        const std::shared_ptr<Predicate>& where, const ExecutionContext& context,
+                                        size_t rowLimit = SIZE_MAX, bool preserveOrder = true) {
+        PlannedInput input;
+        std::vector<bool> consumed(conjuncts.size(), false);
+        auto stats = conjuncts.empty() ? nullptr : table.getStatistics();
+        double selectivity = conjunctSelectivity(table, stats.get(), conjuncts);
+        double indexRows = 0;
+
+        input.plan = planIndexAccess(table, stats.get(), conjuncts, consumed, indexRows);
+        bool indexed = input.plan != nullptr;
+        input.indexed = indexed;
+        input.cost = indexed ? indexRows * INDEX_ROW_COST : table.getRowCount();
+        input.estimatedRows = table.getRowCount() * selectivity;
+        bool stopsEarly = rowsToReach(rowLimit, selectivity) < BATCH_SIZE;
+
+        if (!indexed && !conjuncts.empty() && !stopsEarly && context.parallelism > 1 &&
+            table.getRowCount() >= PARALLEL_SCAN_THRESHOLD) {
+            const Table* source = &table;
+            MorselPlan morselPlan = [source, conjuncts, where](size_t first, size_t last) {
+                return planFilteredScan(*source, conjuncts, where, first, last);
+            };
+            input.plan = std::make_unique<ParallelScanOperator>(table, std::move(morselPlan), context.parallelism,
+                                                                preserveOrder);
+            input.plan->estimatedRows = input.estimatedRows;
+            return input;
+        }
+
+        if (!input.plan && !conjuncts.empty() && table.getRowCount() >= VECTORIZED_SCAN_THRESHOLD && !stopsEarly) {
+            input.plan = planVectorizedScan(table, conjuncts, consumed);
+        }
+        if (!input.plan) {
+            input.plan = std::make_unique<TableScanOperator>(table);
+        }
+
+        std::vector<const Predicate*> residual;
+        for (size_t i = 0; i < conjuncts.size(); i++) {
+            if (!consumed[i]) residual.push_back(conjuncts[i]);
+        }
+        input.plan = addResidualFilter(std::move(input.plan), where, residual);
+        input.plan->estimatedRows = input.estimatedRows;
+        return input;
+    }
+
+    // One JOIN ... ON condition: the two FROM tables it connects, numbered in
+    // FROM order, and the compared column of each
+    struct JoinEdge {
+        size_t left;
+        size_t leftColumn;
+        size_t right;
+        size_t rightColumn;
+    };
+
+    // Rows produced by an equi-join, assuming every key value of the side
+    // with fewer distinct keys finds its matches on the other side
+    static double joinRows(double leftRows, double leftDistinct, double rightRows, double rightDistinct) {
+        leftDistinct = std::min(std::max(leftDistinct, 1.0), std::max(leftRows, 1.0));
+        rightDistinct = std::min(std::max(rightDistinct, 1.0), std::max(rightRows, 1.0));
+        return leftRows * rightRows / std::max(leftDistinct, rightDistinct);
+    }
+
+    // Without statistics the join column is taken to be a key
+    static double distinctKeys(const FromTable& from, size_t column) {
+        auto stats = from.table->getStatistics();
+        return stats ? stats->columns[column].distinctCount : from.table->getRowCount();
+    }
+
+    // An index probe costs about this many sequentially scanned rows
+    static constexpr double INDEX_PROBE_COST = 8.0;
+
+    // Joins the FROM tables in the order the estimates favour: starting with
+    // the input expected to be smallest, it repeatedly joins the table whose
+    // ON condition keeps the intermediate result smallest. Each join then
+    // takes the cheapest algorithm: probing an index on the joined table for
+    // each current row, probing an index on the current input's table for
+    // each joined row (while that input is still a single table), merging
+    // ordered index scans of both, or a hash join built on the smaller
+    // input. SET join_method forces the algorithm but not the order, so the
+    // result's columns need not be in FROM order: columnPositions receives
+    // the position in the result of each column of fromSchema.
+    static PlannedInput planJoins(const SelectQuery& query, std::vector<FromTable>& tables,
+                                  std::vector<PlannedInput>& inputs, const std::vector<Column>& fromSchema,
+                                  const ExecutionContext& context, std::vector<size_t>& columnPositions,
+                                  std::string& error) {
+        std::vector<JoinEdge> edges;
+        for (size_t j = 0; j < query.joins.size(); j++) {
+            const FromTable& joined = tables[j + 1];
+            int leftIndex = resolveColumn(fromSchema, query.joins[j].leftColumn, error);
+            int rightIndex = leftIndex < 0 ? -1 : resolveColumn(fromSchema, query.joins[j].rightColumn, error);
+            if (leftIndex < 0 || rightIndex < 0) return PlannedInput();
+
+            // The ON columns may be written in either order
+            if (static_cast<size_t>(leftIndex) >= joined.offset) {
+                std::swap(leftIndex, rightIndex);
+            }
+            if (static_cast<size_t>(leftIndex) >= joined.offset ||
+                static_cast<size_t>(rightIndex) < joined.offset) {
+                error = "JOIN condition must compare a column of '" + joined.qualifier +
+                        "' with a column of an earlier table";
+                return PlannedInput();
+            }
+
+            size_t owner = j;
+            while (tables[owner].offset > static_cast<size_t>(leftIndex)) owner--;
+            edges.push_back({owner, leftIndex - tables[owner].offset, j + 1, rightIndex - joined.offset});
+        }
+
+        size_t first = 0;
+        for (size_t i = 1; i < inputs.size(); i++) {
+            if (inputs[i].estimatedRows < inputs[first].estimatedRows) first = i;
+        }
+        PlannedInput current = std::move(inputs[first]);
+        std::vector<Column> schema = qualifiedColumns(*tables[first].table, tables[first].qualifier);
+        // Where each joined table's columns start in the current rows
+        std::vector<size_t> layout(tables.size(), SIZE_MAX);
+        layout[first] = 0;
+        // The table current reads, until it is the result of a join
+        const FromTable* single = &tables[first];
+
+        for (size_t step = 1; step < tables.size(); step++) {
+            // Each ON condition adds a table joined to an earlier one, so the
+            // conditions form a tree and every table not yet joined hangs off
+            // the joined ones by at most one of them
+            size_t outer = 0, outerColumn = 0, inner = 0, innerColumn = 0;
+            double estimatedRows = HUGE_VAL;
+            for (const auto& edge : edges) {
+                bool leftJoined = layout[edge.left] != SIZE_MAX;
+                if (leftJoined == (layout[edge.right] != SIZE_MAX)) continue;
+
+                size_t from = leftJoined ? edge.left : edge.right;
+                size_t fromColumn = leftJoined ? edge.leftColumn : edge.rightColumn;
+                size_t to = leftJoined ? edge.right : edge.left;
+                size_t toColumn = leftJoined ? edge.rightColumn : edge.leftColumn;
+                double rows = joinRows(current.estimatedRows, distinctKeys(tables[from], fromColumn),
+                                       inputs[to].estimatedRows, distinctKeys(tables[to], toColumn));
+                if (rows < estimatedRows) {
+                    estimatedRows = rows;
+                    outer = from;
+                    outerColumn = fromColumn;
+                    inner = to;
+                    innerColumn = toColumn;
+                }
+            }
+
+            const FromTable& joined = tables[inner];
+            PlannedInput& right = inputs[inner];
+            size_t leftKey = layout[outer] + outerColumn;
+            layout[inner] = schema.size();
+            auto joinedColumns = qualifiedColumns(*joined.table, joined.qualifier);
+            schema.insert(schema.end(), joinedColumns.begin(), joinedColumns.end());
+
+            // Costs in sequentially scanned rows; HUGE_VAL where an algorithm
+            // does not apply. Merging ordered index scans reads every index
+            // entry of both tables but builds and probes nothing.
+            const BTreeIndex* rightIndexOnKey = columnIndex(*joined.table, innerColumn);
+            const BTreeIndex* leftIndexOnKey = single ? columnIndex(*single->table, outerColumn) : nullptr;
+            double hashCost = current.cost + right.cost + current.estimatedRows + right.estimatedRows;
+            double probeRightCost =
+                rightIndexOnKey ? current.cost + current.estimatedRows * INDEX_PROBE_COST : HUGE_VAL;
+            double probeLeftCost = leftIndexOnKey ? right.cost + right.estimatedRows * INDEX_PROBE_COST : HUGE_VAL;
+            double mergeCost = leftIndexOnKey && rightIndexOnKey
+                                   ? static_cast<double>(single->table->getRowCount() + joined.table->getRowCount())
+                                   : HUGE_VAL;
+
+            if (context.joinMethod == JoinMethod::HASH) {
+                probeRightCost = probeLeftCost = mergeCost = HUGE_VAL;
+            } else if (context.joinMethod == JoinMethod::INDEX_NESTED_LOOP) {
+                mergeCost = HUGE_VAL;
+                if (probeRightCost < HUGE_VAL || probeLeftCost < HUGE_VAL) hashCost = HUGE_VAL;
+            } else if (context.joinMethod == JoinMethod::MERGE) {
+                // Inputs that cannot be read in key order are sorted
+                if (mergeCost == HUGE_VAL) mergeCost = hashCost;
+                probeRightCost = probeLeftCost = hashCost = HUGE_VAL;
+            }
+            double cost = std::min({hashCost, probeRightCost, probeLeftCost, mergeCost});
+
+            PlannedInput result;
+            result.estimatedRows = estimatedRows;
+            result.cost = cost;
+            if (cost == probeRightCost) {
+                // The joined table's own conditions are checked on each
+                // matching row instead of through its planned access path
+                result.plan = std::make_unique<IndexNestedLoopJoinOperator>(
+                    std::move(current.plan), *joined.table, *rightIndexOnKey, leftKey,
+                    residualPredicate(query.where, joined.conjuncts), true, schema);
+            } else if (cost == probeLeftCost) {
+                result.plan = std::make_unique<IndexNestedLoopJoinOperator>(
+                    std::move(right.plan), *single->table, *leftIndexOnKey, innerColumn,
+                    residualPredicate(query.where, single->conjuncts), false, schema);
+            } else if (cost == mergeCost) {
+                auto leftInput = planSortedInput(std::move(current.plan), single, leftKey, query.where, context);
+                auto rightInput = planSortedInput(std::move(right.plan), &joined, innerColumn, query.where, context);
+                result.plan = std::make_unique<MergeJoinOperator>(std::move(leftInput), std::move(rightInput),
+                                                                  leftKey, innerColumn, schema);
+            } else {
+                bool buildLeft = current.estimatedRows < right.estimatedRows;
+                result.plan = std::make_unique<HashJoinOperator>(std::move(current.plan), std::move(right.plan),
+                                                                 leftKey, innerColumn, buildLeft, schema, context);
+            }
+            result.plan->estimatedRows = estimatedRows;
+            current = std::move(result);
+            single = nullptr;
+        }
+
+        // The caller reads columns through these positions instead of copying
+        // every joined row back into FROM order
+        columnPositions.clear();
+        for (size_t t = 0; t < tables.size(); t++) {
+            for (size_t c = 0; c < tables[t].table->getColumns().size(); c++) {
+                columnPositions.push_back(layout[t] + c);
+            }
+        }
+        return current;
+    }
+
+public:
+    // Positions of the rows matching where (bound to the table's columns;
+    // null matches every row) in table order, for statements that change
+    // rows in place. As for SELECT, the rows come from the cheapest index
+    // range if that beats a scan, and the other conditions are checked on
+    // each of them. The caller holds the table lock.
+    static std::vector<size_t> findRows(const Table& table, const std::shared_ptr<Predicate>& where) {
+        std::vector<Predicate*> found;
+        if (where) collectConjuncts(where, found);
+        std::vector<const Predicate*> conjuncts(found.begin(), found.end());
+        std::vector<bool> consumed(conjuncts.size(), false);
+        double indexRows = 0;
+        KeyRange range;
+        int column = -1;
+        if (!conjuncts.empty()) {
+            auto stats = table.getStatistics();
+            column = chooseIndex(table, stats.get(), conjuncts, consumed, indexRows, range);
+        }
+
+        auto matches = [&](size_t position) {
+            const Row& row = table.getRow(position);
+            for (size_t i = 0; i < conjuncts.size(); i++) {
+                if (!consumed[i] && !conjuncts[i]->matches(row)) return false;
+            }
+            return true;
+        };
+
+        std::vector<size_t> positions;
+        if (column < 0) {
+            for (size_t i = 0; i < table.getRowCount(); i++) {
+                if (matches(i)) positions.push_back(i);
+            }
+            return positions;
+        }
+
+        const BTreeIndex& index = *table.getIndex(table.getColumns()[column].name);
+        if (range.isEmpty()) {
+            return positions;
+        }
+        for (auto it = range.first(index), last = range.last(index); it != last; ++it) {
+            for (size_t position : it->second) {
+                if (matches(position)) positions.push_back(position);
+            }
+        }
+        std::sort(positions.begin(), positions.end());
+        return positions;
+    }
+
+    static std::vector<Column> qualifiedColumns(const Table& table, const std::string& qualifier) {
+        std::vector<Column> columns = table.getColumns();
+        for (auto& column : columns) {
+            column.name = qualifier + "." + column.name;
+        }
+        return columns;
+    }
+
+    // Finds a column by name. Qualified names ("users.id") must match
+    // exactly; unqualified names also match a qualified column with that
+    // name, provided only one table has it. Returns -1 and sets error if the
+    // name is unknown or ambiguous.
+    static int resolveColumn(const std::vector<Column>& schema, const std::string& name, std::string& error) {
+        int found = -1;
+        bool qualified = name.find('.') != std::string::npos;
+
+        for (size_t i = 0; i < schema.size(); i++) {
+            const std::string& candidate = schema[i].name;
+            if (candidate == name) return static_cast<int>(i);
+
+            bool suffixMatch = !qualified && candidate.size() > name.size() &&
+                               candidate[candidate.size() - name.size() - 1] == '.' &&
+                               candidate.compare(candidate.size() - name.size(), name.size(), name) == 0;
+            if (suffixMatch) {
+                if (found >= 0) {
+                    error = "Column '" + name + "' is ambiguous";
+                    return -1;
+                }
+                found = static_cast<int>(i);
+            }
+        }
+
+        if (found < 0) {
+            error = "Column '" + name + "' not found";
+        }
+        return found;
+    }
+
+    // Resolves the column names in a predicate against a schema and converts
+    // integer literals compared with REAL columns to doubles. Returns false
+    // and sets error for unknown columns.
+    static bool bindPredicate(Predicate& pred, const std::vector<Column>& schema, std::string& error) {
+        if (pred.kind != Predicate::Kind::COMPARE) {
+            for (auto& child : pred.children) {
+                if (!bindPredicate(*child, schema, error)) return false;
+            }
+            return true;
+        }
+
+        pred.columnIndex = resolveColumn(schema, pred.column, error);
+        if (pred.columnIndex < 0) {
+            return false;
+        }
+
+        if (schema[pred.columnIndex].type == DataType::REAL && pred.literal.type == DataType::INTEGER) {
+            pred.literal = Value(static_cast<double>(std::get<int>(pred.literal.data)));
+        }
+        return true;
+    }
+
+    // Largest LIMIT (plus OFFSET) answered with a Top-N heap; beyond this
+    // a full sort, which can spill, is used instead
+    static constexpr size_t TOP_N_MAX_ROWS = 65536;
+
+    // Comparing two normalised sort keys costs about this many scanned rows
+    static constexpr double SORT_COMPARE_COST = 0.25;
+
+    static double sortCost(double rows) {
+        return rows * std::log2(std::max(rows, 2.0)) * SORT_COMPARE_COST;
+    }
+
+    static std::unique_ptr<Operator> planSort(std::unique_ptr<Operator> input, const std::vector<SortKey>& keys,
+                                              const SelectQuery& query, const ExecutionContext& context) {
+        if (query.hasLimit && query.limit <= TOP_N_MAX_ROWS && query.offset <= TOP_N_MAX_ROWS - query.limit) {
+            return std::make_unique<TopNOperator>(std::move(input), keys, query.limit + query.offset);
+        }
+        return std::make_unique<SortOperator>(std::move(input), keys, context);
+    }
+
+    static std::unique_ptr<Operator> planLimit(std::unique_ptr<Operator> input, const SelectQuery& query) {
+        if (!query.hasLimit && query.offset == 0) {
+            return input;
+        }
+        size_t limit = query.hasLimit ? query.limit : SIZE_MAX;
+        return std::make_unique<LimitOperator>(std::move(input), limit, query.offset);
+    }
+
+    // Tables with at least this many rows are aggregated in parallel when
+    // they would be scanned anyway
+    static constexpr size_t PARALLEL_AGGREGATE_THRESHOLD = 2 * MORSEL_SIZE;
+
+    // Groups the filtered input on the GROUP BY columns and lays out the
+    // aggregate results in select list order. With a scanSource, the input
+    // plan is replaced by a parallel aggregation over that table.
+    static std::unique_ptr<Operator> planAggregate(std::unique_ptr<Operator> input, const SelectQuery& query,
+                                                   const std::vector<Column>& inputSchema,
+                                                   const FromTable* scanSource, size_t parallelism,
+                                                   std::string& error) {
+        if (query.columns.empty()) {
+            error = "SELECT * cannot be used with GROUP BY";
+            return nullptr;
+        }
+
+        std::vector<size_t> keyColumns;
+        std::vector<Column> schema;
+        for (const auto& name : query.groupBy) {
+            int colIndex = resolveColumn(inputSchema, name, error);
+            if (colIndex < 0) return nullptr;
+            keyColumns.push_back(colIndex);
+            schema.push_back(Column(name, inputSchema[colIndex].type));
+        }
+
+        // Each select item maps to a key column or to an aggregate
+        // appended after the keys; repeated aggregates are computed once
+        std::vector<AggregateSpec> aggregates;
+        std::vector<size_t> projection;
+        for (const auto& item : query.columns) {
+            int colIndex = -1;
+            if (!item.column.empty()) {
+                colIndex = resolveColumn(inputSchema, item.column, error);
+                if (colIndex < 0) return nullptr;
+            }
+
+            if (item.function == AggregateFunction::NONE) {
+                auto key = std::find(keyColumns.begin(), keyColumns.end(), static_cast<size_t>(colIndex));
+                if (key == keyColumns.end()) {
+                    error = "Column '" + item.column + "' must appear in GROUP BY or be used in an aggregate";
+                    return nullptr;
+                }
+                projection.push_back(key - keyColumns.begin());
+                continue;
+            }
+
+            DataType inputType = colIndex >= 0 ? inputSchema[colIndex].type : DataType::INTEGER;
+            size_t position = 0;
+            while (position < aggregates.size() &&
+                   (aggregates[position].function != item.function || aggregates[position].column != colIndex)) {
+                position++;
+            }
+            if (position == aggregates.size()) {
+                AggregateSpec spec;
+                if (!AggregateSpec::create(item.function, colIndex, inputType, spec)) {
+                    error = item.label() + " requires a numeric column";
+                    return nullptr;
+                }
+                aggregates.push_back(spec);
+                schema.push_back(Column(item.label(), spec.resultType()));
+            }
+            projection.push_back(keyColumns.size() + position);
+        }
+
+        std::unique_ptr<Operator> plan;
+        if (scanSource) {
+            plan = std::make_unique<ParallelHashAggregateOperator>(
+                *scanSource->table, residualPredicate(query.where, scanSource->conjuncts), keyColumns, aggregates,
+                schema, parallelism, describeConjuncts(scanSource->conjuncts));
+        } else {
+            plan = std::make_unique<HashAggregateOperator>(std::move(input), keyColumns, aggregates, schema);
+        }
+        if (!isIdentityProjection(projection, schema.size())) {
+            plan = std::make_unique<ProjectOperator>(std::move(plan), projection);
+        }
+        return plan;
+    }
+
+    // Returns nullptr and sets error if the query references unknown tables
+    // or columns. If deferredProjection is given, a plain column projection
+    // is not planned but returned there (as column positions in the plan's
+    // rows), so the caller can read the selected columns in place.
+    static std::unique_ptr<Operator> planSelect(Database& db, const SelectQuery& query,
+                                                const ExecutionContext& context, std::string& error,
+                                                std::vector<size_t>* deferredProjection = nullptr) {
+        // Lay out the FROM tables side by side; qualified names in this
+        // schema are what WHERE, ON and the select list refer to
+        std::vector<FromTable> tables;
+        std::vector<Column> fromSchema;
+        std::vector<TableRef> refs = {query.from};
+        for (const auto& join : query.joins) {
+            refs.push_back(join.table);
+        }
+        for (const auto& ref : refs) {
+            const Table* table = db.getTable(ref.name);
+            if (!table) {
+                error = "Table '" + ref.name + "' not found";
+                return nullptr;
+            }
+            tables.push_back({table, ref.alias, fromSchema.size(), {}});
+            auto columns = qualifiedColumns(*table, ref.alias);
+            fromSchema.insert(fromSchema.end(), columns.begin(), columns.end());
+        }
+
+        // Resolve the projection list up front so bad queries fail before
+        // any rows are touched
+        bool aggregating = !query.groupBy.empty();
+        for (const auto& item : query.columns) {
+            aggregating = aggregating || item.function != AggregateFunction::NONE;
+        }
+        std::vector<size_t> projection;
+        if (!aggregating) {
+            for (const auto& item : query.columns) {
+                int colIndex = resolveColumn(fromSchema, item.column, error);
+                if (colIndex < 0) return nullptr;
+                projection.push_back(colIndex);
+            }
+        }
+
+        // Conditions on a single table are pushed down to that table's
+        // access path; the rest are checked after the joins
+        std::vector<Predicate*> conjuncts;
+        std::vector<Predicate*> joinResidual;
+        if (query.where) {
+            collectConjuncts(query.where, conjuncts);
+        }
+        for (Predicate* conjunct : conjuncts) {
+            std::vector<std::string> names;
+            collectColumnNames(*conjunct, names);
+            int owner = -1;
+            for (const auto& name : names) {
+                int colIndex = resolveColumn(fromSchema, name, error);
+                if (colIndex < 0) return nullptr;
+                int tableIndex = static_cast<int>(tables.size()) - 1;
+                while (tables[tableIndex].offset > static_cast<size_t>(colIndex)) tableIndex--;
+                owner = (owner == -1 || owner == tableIndex) ? tableIndex : -2;
+            }
+
+            if (owner >= 0) {
+                FromTable& from = tables[owner];
+                bindPredicate(*conjunct, qualifiedColumns(*from.table, from.qualifier), error);
+                from.conjuncts.push_back(conjunct);
+            } else {
+                bindPredicate(*conjunct, fromSchema, error);
+                joinResidual.push_back(conjunct);
+            }
+        }
+
+        // Without joins, sorting or grouping, LIMIT caps how many rows the
+        // table access has to produce
+        size_t rowLimit = SIZE_MAX;
+        if (query.hasLimit && query.joins.empty() && query.orderBy.empty() && !aggregating) {
+            rowLimit = query.offset > SIZE_MAX - query.limit ? SIZE_MAX : query.limit + query.offset;
+        }
+
+        std::vector<PlannedInput> inputs;
+        for (const auto& from : tables) {
+            inputs.push_back(planTableAccess(*from.table, from.conjuncts, query.where, context, rowLimit,
+                                             query.joins.empty() && !aggregating));
+        }
+
+        bool parallelAggregate = aggregating && query.joins.empty() && !inputs[0].indexed &&
+                                 context.parallelism > 1 &&
+                                 tables[0].table->getRowCount() >= PARALLEL_AGGREGATE_THRESHOLD;
+
+        std::vector<size_t> positions;
+        PlannedInput planned = planJoins(query, tables, inputs, fromSchema, context, positions, error);
+        if (!planned.plan) return nullptr;
+
+        // Everything above the joins refers to columns by their place in
+        // the joined rows, which differs from fromSchema if the joins were
+        // reordered; inputSchema is fromSchema in that order
+        std::vector<Column> inputSchema = fromSchema;
+        for (size_t i = 0; i < fromSchema.size(); i++) {
+            inputSchema[positions[i]] = fromSchema[i];
+        }
+        bool reordered = !isIdentityProjection(positions, positions.size());
+        if (reordered) {
+            for (Predicate* conjunct : joinResidual) {
+                bindPredicate(*conjunct, inputSchema, error);
+            }
+            if (projection.empty() && !aggregating) {
+                projection = positions;
+            } else {
+                for (auto& column : projection) column = positions[column];
+            }
+        }
+        std::unique_ptr<Operator> plan = addResidualFilter(
+            std::move(planned.plan), query.where, std::vector<const Predicate*>(joinResidual.begin(), joinResidual.end()));
+
+        if (aggregating) {
+            plan = planAggregate(std::move(plan), query, inputSchema, parallelAggregate ? &tables[0] : nullptr,
+                                 context.parallelism, error);
+            if (!plan) return nullptr;
+
+            // Aggregated rows can only be ordered by what the select list produces
+            if (!query.orderBy.empty()) {
+                std::vector<SortKey> keys;
+                const auto& schema = plan->getSchema();
+                for (const auto& order : query.orderBy) {
+                    int colIndex = resolveColumn(schema, order.item.label(), error);
+                    if (colIndex < 0) return nullptr;
+                    keys.push_back({static_cast<size_t>(colIndex), order.descending});
+                }
+                plan = planSort(std::move(plan), keys, query, context);
+            }
+            return planLimit(std::move(plan), query);
+        }
+
+        // Sorting before the projection allows ordering by columns that are
+        // not selected, and sorts pointers to table rows rather than copies
+        if (!query.orderBy.empty()) {
+            std::vector<SortKey> keys;
+            for (const auto& order : query.orderBy) {
+                if (order.item.function != AggregateFunction::NONE) {
+                    error = "Aggregates in ORDER BY require GROUP BY or aggregates in the select list";
+                    return nullptr;
+                }
+                int colIndex = resolveColumn(inputSchema, order.item.column, error);
+                if (colIndex < 0) return nullptr;
+                keys.push_back({static_cast<size_t>(colIndex), order.descending});
+            }
+
+            // An ordered walk of an index on the sort column needs no sort at
+            // all, and stops reading the table once the LIMIT is reached.
+            // Without a LIMIT it reads its whole key range through the index,
+            // so it is only taken if that beats the planned access plus a sort.
+            bool ordered = query.joins.empty() && keys.size() == 1 && columnIndex(*tables[0].table, keys[0].column);
+            if (ordered && !query.hasLimit) {
+                double walkCost = orderedAccessRows(tables[0], keys[0].column) * INDEX_ROW_COST;
+                ordered = walkCost < planned.cost + sortCost(planned.estimatedRows);
+            }
+            if (ordered) {
+                plan = planOrderedAccess(tables[0], keys[0].column, query.where, keys[0].descending);
+            } else {
+                plan = planSort(std::move(plan), keys, query, context);
+            }
+        }
+
+        // Scans hand out pointers into table storage, so projecting directly
+        // above the access path means only the selected columns are copied
+        if (!projection.empty() && !isIdentityProjection(projection, fromSchema.size())) {
+            if (deferredProjection) {
+                *deferredProjection = projection;
+            } else {
+                plan = std::make_unique<ProjectOperator>(std::move(plan), projection);
+            }
+        }
+
+        return planLimit(std::move(plan), query);
+    }
+};
+
+// Materialized views: "CREATE MATERIALIZED VIEW <name> AS SELECT ..." over
+// one table, grouping and aggregating its rows. The view keeps one row per
+// group in an ordinary table that queries read like any other. It listens
+// to the rows its source inserts and deletes and folds each one into the
+// running state of its group, then rewrites only that group's row, so reads
+// never recompute anything and a write costs the same whatever the size of
+// the source. MIN and MAX keep the values of their group in a sorted
+// multiset so that deleting the current extreme finds the next one directly.
+class MaterializedView : public TableListener {
+private:
+    struct Group {
+        std::vector<Value> key;
+        std::vector<AggregateState> states;
+        std::vector<std::map<Value, size_t>> values; // per aggregate, for MIN and MAX
+        size_t rows = 0;                            // source rows in the group
+    };
+
+    struct KeyHash {
+        size_t operator()(const std::vector<Value>& key) const {
+            uint64_t h = 0;
+            for (const auto& value : key) {
+                h = h * 0x9E3779B97F4A7C15ULL + hashValue(value);
+            }
+            return static_cast<size_t>(h);
+        }
+    };
+
+    Table* table = nullptr; // the view's rows, in the same order as groups
+    std::shared_ptr<Predicate> where;
+    std::vector<size_t> keyColumns;
+    std::vector<AggregateSpec> aggregates;
+    std::vector<size_t> projection; // per view column: a key, or keys + aggregate
+    bool grouped;                   // without GROUP BY there is always one row
+    std::vector<Group> groups;
+    std::unordered_map<std::vector<Value>, size_t, KeyHash> groupPositions;
+
+    MaterializedView() = default;
+
+    static bool isExtreme(const AggregateSpec& spec) {
+        return spec.function == AggregateFunction::MIN || spec.function == AggregateFunction::MAX;
+    }
+
+    // Undoes AggregateSpec::update for one input value
+    static void retract(const AggregateSpec& spec, AggregateState& state, std::map<Value, size_t>& values,
+                        const Value& value) {
+        switch (spec.function) {
+            case AggregateFunction::COUNT:
+                state.count--;
+                return;
+            case AggregateFunction::SUM:
+            case AggregateFunction::AVG:
+                if (spec.inputType == DataType::INTEGER) {
+                    if (const int* v = std::get_if<int>(&value.data)) {
+                        state.intValue -= *v;
+                        state.count--;
+                    }
+                } else if (double v; realInput(value, v)) {
+                    state.realValue -= v;
+                    state.count--;
+                }
+                return;
+            default: {
+                auto it = values.find(Table::toColumnType(value, spec.inputType));
+                if (it == values.end()) return;
+                if (--it->second == 0) values.erase(it);
+                state = AggregateState();
+                if (!values.empty()) {
+                    bool isMin = spec.function == AggregateFunction::MIN;
+                    spec.update(state, isMin ? values.begin()->first : values.rbegin()->first);
+                }
+                return;
+            }
+        }
+    }
+
+    // Adds (sign > 0) or removes a source row from its group's state and
+    // returns the group's position, or SIZE_MAX if the row is not in the view
+    size_t fold(const Row& row, int sign) {
+        if (where && !where->matches(row)) return SIZE_MAX;
+
+        std::vector<Value> key;
+        key.reserve(keyColumns.size());
+        for (size_t column : keyColumns) {
+            key.push_back(row[column]);
+        }
+        auto found = groupPositions.find(key);
+        size_t position;
+        if (found != groupPositions.end()) {
+            position = found->second;
+        } else if (sign > 0) {
+            position = groups.size();
+            groups.push_back(Group{key, std::vector<AggregateState>(aggregates.size()),
+                                   std::vector<std::map<Value, size_t>>(aggregates.size()), 0});
+            groupPositions.emplace(std::move(key), position);
+        } else {
+            return SIZE_MAX;
+        }
+
+        Group& group = groups[position];
+        if (sign > 0) group.rows++;
+        else group.rows--;
+        for (size_t i = 0; i < aggregates.size(); i++) {
+            const AggregateSpec& spec = aggregates[i];
+            const Value& value = row[spec.column >= 0 ? spec.column : 0];
+            if (sign < 0) {
+                retract(spec, group.states[i], group.values[i], value);
+                continue;
+            }
+            spec.update(group.states[i], value);
+            Value input = Table::toColumnType(value, spec.inputType);
+            if (isExtreme(spec) && input.type == spec.inputType) {
+                group.values[i][input]++;
+            }
+        }
+        return position;
+    }
+
+    std::vector<Value> groupRow(const Group& group) const {
+        std::vector<Value> values;
+        values.reserve(projection.size());
+        for (size_t source : projection) {
+            if (source < keyColumns.size()) {
+                values.push_back(group.key[source]);
+            } else {
+                size_t aggregate = source - keyColumns.size();
+                values.push_back(aggregates[aggregate].result(group.states[aggregate]));
+            }
+        }
+        return values;
+    }
+
+    // Brings the view's row for a group in line with its state: rewrites
+    // it, or removes it once the group has no rows left
+    void refreshGroup(size_t position, bool added) {
+        Group& group = groups[position];
+        if (group.rows > 0 || !grouped) {
+            if (added && position == table->getRowCount()) {
+                table->insertRow(groupRow(group));
+            } else {
+                table->updateRow(position, groupRow(group));
+            }
+            return;
+        }
+
+        // The last group takes the place of the removed one, as its row does
+        groupPositions.erase(group.key);
+        table->removeRowAt(position);
+        if (position != groups.size() - 1) {
+            groups[position] = std::move(groups.back());
+            groupPositions[groups[position].key] = position;
+        }
+        groups.pop_back();
+    }
+
+public:
+    void rowInserted(const Row& row) override {
+        size_t position = fold(row, 1);
+        if (position != SIZE_MAX) refreshGroup(position, true);
+    }
+
+    void rowDeleted(const Row& row) override {
+        size_t position = fold(row, -1);
+        if (position != SIZE_MAX) refreshGroup(position, false);
+    }
+
+    // Creates the view's table in db, fills it from the source table and
+    // registers the view. Views must aggregate a single table, without
+    // ORDER BY or LIMIT; returns false and sets error otherwise. The caller
+    // holds the source table's lock exclusively.
+    static bool create(Database& db, const std::string& name, const SelectQuery& select,
+                       const std::string& definition, std::string& error) {
+        if (db.getTable(name)) {
+            error = "Table '" + name + "' already exists";
+            return false;
+        }
+        Table* source = db.getTable(select.from.name);
+        if (!source) {
+            error = "Table '" + select.from.name + "' not found";
+            return false;
+        }
+        if (db.isView(select.from.name)) {
+            error = "Materialized views cannot be defined over other views";
+            return false;
+        }
+        if (!select.joins.empty() || !select.orderBy.empty() || select.hasLimit || select.offset > 0) {
+            error = "Materialized views support only SELECT ... FROM <table> [WHERE ...] [GROUP BY ...]";
+            return false;
+        }
+
+        std::vector<Column> sourceSchema = QueryPlanner::qualifiedColumns(*source, select.from.alias);
+        auto view = std::unique_ptr<MaterializedView>(new MaterializedView());
+        view->grouped = !select.groupBy.empty();
+        if (select.where) {
+            view->where = select.where;
+            if (!QueryPlanner::bindPredicate(*view->where, sourceSchema, error)) return false;
+        }
+        for (const auto& column : select.groupBy) {
+            int colIndex = QueryPlanner::resolveColumn(sourceSchema, column, error);
+            if (colIndex < 0) return false;
+            view->keyColumns.push_back(colIndex);
+        }
+
+        // View columns are named after the group columns and, for
+        // aggregates, "<function>_<column>" (count, sum_score, ...), so
+        // that queries over the view can refer to them
+        static const char* const functionNames[] = {"", "count", "sum", "avg", "min", "max"};
+        std::vector<Column> columns;
+        bool aggregating = false;
+        for (const auto& item : select.columns) {
+            int colIndex = -1;
+            if (!item.column.empty()) {
+                colIndex = QueryPlanner::resolveColumn(sourceSchema, item.column, error);
+                if (colIndex < 0) return false;
+            }
+            std::string columnName = colIndex >= 0 ? source->getColumns()[colIndex].name : "";
+
+            if (item.function == AggregateFunction::NONE) {
+                auto key = std::find(view->keyColumns.begin(), view->keyColumns.end(), static_cast<size_t>(colIndex));
+                if (key == view->keyColumns.end()) {
+                    error = "Column '" + item.column + "' must appear in GROUP BY or be used in an aggregate";
+                    return false;
+                }
+                view->projection.push_back(key - view->keyColumns.begin());
+                columns.push_back(Column(columnName, source->getColumns()[colIndex].type));
+                continue;
+            }
+
+            aggregating = true;
+            AggregateSpec spec;
+            DataType inputType = colIndex >= 0 ? source->getColumns()[colIndex].type : DataType::INTEGER;
+            if (!AggregateSpec::create(item.function, colIndex, inputType, spec)) {
+                error = item.label() + " requires a numeric column";
+                return false;
+            }
+            view->projection.push_back(view->keyColumns.size() + view->aggregates.size());
+            view->aggregates.push_back(spec);
+            std::string function = functionNames[static_cast<int>(item.function)];
+            columns.push_back(Column(columnName.empty() ? function : function + "_" + columnName, spec.resultType()));
+        }
+        if (!aggregating && !view->grouped) {
+            error = "Materialized views must use GROUP BY or aggregates";
+            return false;
+        }
+        for (size_t i = 0; i < columns.size(); i++) {
+            for (size_t j = 0; j < i; j++) {
+                if (columns[i].name == columns[j].name) {
+                    error = "Column '" + columns[i].name + "' appears twice in the view";
+                    return false;
+                }
+            }
+        }
+
+        // A single group column is the view's key and gets an index, so a
+        // group's row is found without scanning the view
+        if (view->keyColumns.size() == 1) {
+            auto key = std::find(view->projection.begin(), view->projection.end(), 0);
+            if (key != view->projection.end()) columns[key - view->projection.begin()].primaryKey = true;
+        }
+
+        if (!view->grouped) {
+            view->groups.push_back(Group{{}, std::vector<AggregateState>(view->aggregates.size()),
+                                         std::vector<std::map<Value, size_t>>(view->aggregates.size()), 0});
+            view->groupPositions.emplace(std::vector<Value>(), 0);
+        }
+        for (size_t i = 0; i < source->getRowCount(); i++) {
+            view->fold(source->getRow(i), 1);
+        }
+
+        db.createTable(name, columns);
+        view->table = db.getTable(name);
+        for (const auto& group : view->groups) {
+            view->table->insertRow(view->groupRow(group));
+        }
+        db.addView(name, select.from.name, definition, std::move(view));
+        return true;
+    }
+};
+
+// SQL Query Parser
+class QueryParser {
+private:
+    std::string query;
+    std::vector<std::string> tokens;
+    size_t currentToken = 0;
+    // Tables a WHERE clause may refer to, under the qualifier each is named by
+    std::vector<std::pair<std::string, const Table*>> conditionTables;
+
+    void tokenize() {
+        tokens.clear();
+        std::regex tokenRegex(R"([a-zA-Z_][a-zA-Z0-9_]*(?:\.[a-zA-Z_][a-zA-Z0-9_]*)?|'[^']*'|"[^"]*"|-?\d+\.?\d*|<=|>=|<>|!=|[(),;=<>]|[+\-*/])");
+        std::sregex_iterator iter(query.begin(), query.end(), tokenRegex);
+        std::sregex_iterator end;
+
+        for (; iter != end; ++iter) {
+            tokens.push_back(iter->str());
+        }
+    }
+
+    std::string getCurrentToken() const {
+        return currentToken < tokens.size() ? tokens[currentToken] : "";
+    }
+
+    void consumeToken() {
+        if (currentToken < tokens.size()) {
+            currentToken++;
+        }
+    }
+
+    bool expectToken(const std::string& expected) {
+        if (getCurrentToken() == expected) {
+            consumeToken();
+            return true;
+        }
+        return false;
+    }
+
+    // Keywords in WHERE and LIMIT clauses are matched case-insensitively
+    bool isKeyword(const std::string& token, const std::string& keyword) const {
+        if (token.size() != keyword.size()) return false;
+        for (size_t i = 0; i < token.size(); i++) {
+            if (::toupper(static_cast<unsigned char>(token[i])) != keyword[i]) return false;
+        }
+        return true;
+    }
+
+    bool expectKeyword(const std::string& keyword) {
+        if (isKeyword(getCurrentToken(), keyword)) {
+            consumeToken();
+            return true;
+        }
+        return false;
+    }
+
+    bool parseCompareOp(const std::string& token, CompareOp& op) {
+        if (token == "=") op = CompareOp::EQ;
+        else if (token == "<>" || token == "!=") op = CompareOp::NE;
+        else if (token == "<") op = CompareOp::LT;
+        else if (token == "<=") op = CompareOp::LE;
+        else if (token == ">") op = CompareOp::GT;
+        else if (token == ">=") op = CompareOp::GE;
+        else return false;
+        return true;
+    }
+
+    bool isLiteral(const std::string& token) const {
+        if (token.empty()) return false;
+        char first = token.front();
+        return first == '\'' || first == '"' || first == '-' || ::isdigit(static_cast<unsigned char>(first)) ||
+               isKeyword(token, "TRUE") || isKeyword(token, "FALSE");
+    }
+
+    // Whether token names a column of one of the conditionTables; "q.col"
+    // must match the table qualified as q
+    bool isConditionColumn(const std::string& token) const {
+        size_t dot = token.find('.');
+        for (const auto& entry : conditionTables) {
+            if (!entry.second) continue;
+            if (dot != std::string::npos && token.substr(0, dot) != entry.first) continue;
+            std::string name = dot == std::string::npos ? token : token.substr(dot + 1);
+            for (const auto& column : entry.second->getColumns()) {
+                if (column.name == name) return true;
+            }
+        }
+        return false;
+    }
+
+    // Grammar, lowest precedence first:
+    //   or   := and { OR and }
+    //   and  := not { AND not }
+    //   not  := NOT not | primary
+    //   primary := ( or ) | column op literal | literal op column
+    std::shared_ptr<Predicate> parseOr() {
+        auto left = parseAnd();
+        if (!left || !isKeyword(getCurrentToken(), "OR")) return left;
+
+        auto node = std::make_shared<Predicate>();
+        node->kind = Predicate::Kind::OR;
+        node->children.push_back(left);
+        while (expectKeyword("OR")) {
+            auto right = parseAnd();
+            if (!right) return nullptr;
+            node->children.push_back(right);
+        }
+        return node;
+    }
+
+    std::shared_ptr<Predicate> parseAnd() {
+        auto left = parseNot();
+        if (!left || !isKeyword(getCurrentToken(), "AND")) return left;
+
+        auto node = std::make_shared<Predicate>();
+        node->kind = Predicate::Kind::AND;
+        node->children.push_back(left);
+        while (expectKeyword("AND")) {
+            auto right = parseNot();
+            if (!right) return nullptr;
+            node->children.push_back(right);
+        }
+        return node;
+    }
+
+    std::shared_ptr<Predicate> parseNot() {
+        if (expectKeyword("NOT")) {
+            auto operand = parseNot();
+            if (!operand) return nullptr;
+            auto node = std::make_shared<Predicate>();
+            node->kind = Predicate::Kind::NOT;
+            node->children.push_back(operand);
+            return node;
+        }
+        return parsePrimary();
+    }
+
+    std::shared_ptr<Predicate> parsePrimary() {
+        if (expectToken("(")) {
+            auto inner = parseOr();
+            if (!inner || !expectToken(")")) return nullptr;
+            return inner;
+        }
+
+        std::string left = getCurrentToken();
+        consumeToken();
+        CompareOp op;
+        if (!parseCompareOp(getCurrentToken(), op)) return nullptr;
+        consumeToken();
+        std::string right = getCurrentToken();
+        if (right.empty()) return nullptr;
+        consumeToken();
+        // Conditions compare a column with a literal. Bare words that are not
+        // columns are taken as text, but "a.x = b.y" would otherwise compare
+        // a.x with the text 'b.y'
+        bool leftColumn = !isLiteral(left) && isConditionColumn(left);
+        bool rightColumn = !isLiteral(right) && isConditionColumn(right);
+        if (leftColumn && rightColumn) return nullptr;
+
+        auto node = std::make_shared<Predicate>();
+        if (rightColumn || (isLiteral(left) && !isLiteral(right))) {
+            // "5 < id" is stored as "id > 5"
+            static const CompareOp mirrored[] = {CompareOp::EQ, CompareOp::NE, CompareOp::GT,
+                                                 CompareOp::GE, CompareOp::LT, CompareOp::LE};
+            node->column = right;
+            node->op = mirrored[static_cast<int>(op)];
+            node->literal = parseValue(left);
+        } else {
+            node->column = left;
+            node->op = op;
+            node->literal = parseValue(right);
+        }
+        return node;
+    }
+
+    // <table> [[AS] alias]
+    bool parseTableRef(TableRef& ref) {
+        static const char* const clauseKeywords[] = {"WHERE", "JOIN", "INNER", "ON", "GROUP", "ORDER", "LIMIT", "OFFSET"};
+        
+        ref.name = getCurrentToken();
+        if (ref.name.empty()) return false;
+        consumeToken();
+        ref.alias = ref.name;
+        
+        bool explicitAlias = expectKeyword("AS");
+        std::string alias = getCurrentToken();
+        bool isClause = false;
+        for (const char* keyword : clauseKeywords) {
+            isClause = isClause || isKeyword(alias, keyword);
+        }
+        if (!alias.empty() && !isClause && (::isalpha(static_cast<unsigned char>(alias[0])) || alias[0] == '_')) {
+            ref.alias = alias;
+            consumeToken();
+        } else if (explicitAlias) {
+            return false;
+        }
+        return true;
+    }
+
+    DataType parseDataType(const std::string& typeStr) {
+        std::string upper = typeStr;
+        std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+        
+        if (upper == "INTEGER" || upper == "INT") return DataType::INTEGER;
+        if (upper == "TEXT" || upper == "VARCHAR") return DataType::TEXT;
+        if (upper == "REAL" || upper == "DOUBLE") return DataType::REAL;
+        if (upper == "BOOLEAN" || upper == "BOOL") return DataType::BOOLEAN;
+        
+        return DataType::TEXT; // Default
+    }
+
+    Value parseValue(const std::string& valueStr) {
+        // Remove quotes if present
+        if ((valueStr.front() == '\'' && valueStr.back() == '\'') ||
+            (valueStr.front() == '"' && valueStr.back() == '"')) {
+            return Value(valueStr.substr(1, valueStr.length() - 2));
+        }
+        
+        // Try to parse as number
+        if (valueStr.find('.') != std::string::npos) {
+            try {
+                return Value(std::stod(valueStr));
+            } catch (...) {}
+        } else {
+            try {
+                return Value(std::stoi(valueStr));
+            } catch (...) {}
+        }
+        
+        // Parse as boolean
+        if (valueStr == "true" || valueStr == "TRUE") return Value(true);
+        if (valueStr == "false" || valueStr == "FALSE") return Value(false);
+        
+        return Value(valueStr);
+    }
+
+public:
+    QueryParser(const std::string& sql) : query(sql), currentToken(0) {
+        tokenize();
+    }
+
+    // The query's tokens separated by single spaces, without a trailing
+    // semicolon: queries that differ only in layout normalise to the same
+    // text. Case is kept, since identifiers and literals are case-sensitive.
+    static std::string normalize(const std::string& sql) {
+        QueryParser parser(sql);
+        std::vector<std::string>& tokens = parser.tokens;
+        if (!tokens.empty() && tokens.back() == ";") tokens.pop_back();
+        std::string text;
+        for (const auto& token : tokens) {
+            if (!text.empty()) text += ' ';
+            text += token;
+        }
+        return text;
+    }
+
+    bool parseCreateTable(Database& db, std::string& tableName, std::vector<Column>& columns) {
+        if (!expectToken("CREATE")) return false;
+        if (!expectToken("TABLE")) return false;
+        
+        tableName = getCurrentToken();
+        consumeToken();
+        
+        if (!expectToken("(")) return false;
+        
+        while (getCurrentToken() != ")" && currentToken < tokens.size()) {
+            std::string colName = getCurrentToken();
+            consumeToken();
+            
+            std::string typeStr = getCurrentToken();
+            consumeToken();
+            
+            Column col(colName, parseDataType(typeStr));
+            
+            // Check for constraints
+            while (getCurrentToken() != "," && getCurrentToken() != ")" && currentToken < tokens.size()) {
+                std::string constraint = getCurrentToken();
+                std::transform(constraint.begin(), constraint.end(), constraint.begin(), ::toupper);
+                
+                if (constraint == "PRIMARY") {
+                    consumeToken();
+                    if (expectToken("KEY")) {
+                        col.primaryKey = true;
+                    }
+                } else if (constraint == "NOT") {
+                    consumeToken();
+                    if (expectToken("NULL")) {
+                        col.notNull = true;
+                    }
+                } else if (constraint == "AUTO_INCREMENT" || constraint == "AUTOINCREMENT") {
+                    col.autoIncrement = true;
+                    consumeToken();
+                } else {
+                    consumeToken();
+                }
+            }
+            
+            columns.push_back(col);
+            
+            if (getCurrentToken() == ",") {
+                consumeToken();
+            }
         }
+        
+        return expectToken(")");
     }
 
-    bool expectToken(const std::string& expected) {
-        if (getCurrentToken() == expected) {
+    bool parseInsert(Database& db, std::string& tableName, std::vector<Value>& values) {
+        if (!expectToken("INSERT")) return false;
+        if (!expectToken("INTO")) return false;
+        
+        tableName = getCurrentToken();
+        consumeToken();
+        
+        if (!expectToken("VALUES")) return false;
+        if (!expectToken("(")) return false;
+        
+        while (getCurrentToken() != ")" && currentToken < tokens.size()) {
+            values.push_back(parseValue(getCurrentToken()));
             consumeToken();
+            
+            if (getCurrentToken() == ",") {
+                consumeToken();
+            }
+        }
+        
+        return expectToken(")");
+    }
+
+    static bool isIdentifier(const std::string& token) {
+        return !token.empty() && (::isalpha(static_cast<unsigned char>(token[0])) || token[0] == '_');
+    }
+
+    // <column> | COUNT(*) | COUNT|SUM|AVG|MIN|MAX(<column>)
+    bool parseSelectItem(SelectItem& item) {
+        static const std::pair<const char*, AggregateFunction> aggregates[] = {
+            {"COUNT", AggregateFunction::COUNT}, {"SUM", AggregateFunction::SUM},
+            {"AVG", AggregateFunction::AVG}, {"MIN", AggregateFunction::MIN}, {"MAX", AggregateFunction::MAX}};
+        
+        std::string token = getCurrentToken();
+        if (!isIdentifier(token) || token == "FROM") return false;
+        consumeToken();
+        
+        if (getCurrentToken() != "(") {
+            item.column = token;
             return true;
         }
+        for (const auto& aggregate : aggregates) {
+            if (isKeyword(token, aggregate.first)) item.function = aggregate.second;
+        }
+        if (item.function == AggregateFunction::NONE) return false;
+        consumeToken();
+        
+        if (item.function == AggregateFunction::COUNT && expectToken("*")) {
+            return expectToken(")");
+        }
+        item.column = getCurrentToken();
+        if (!isIdentifier(item.column)) return false;
+        consumeToken();
+        return expectToken(")");
+    }
+
+    // Non-negative row count for LIMIT and OFFSET
+    bool parseCount(size_t& count) {
+        std::string token = getCurrentToken();
+        if (token.empty() || !::isdigit(static_cast<unsigned char>(token[0]))) return false;
+        try {
+            count = std::stoul(token);
+        } catch (...) {
+            return false;
+        }
+        consumeToken();
+        return true;
+    }
+
+    bool parseSelect(Database& db, SelectQuery& select) {
+        if (!expectToken("SELECT")) return false;
+        
+        // Column list; an empty list means SELECT *
+        if (!expectToken("*")) {
+            while (true) {
+                SelectItem item;
+                if (!parseSelectItem(item)) return false;
+                select.columns.push_back(item);
+                
+                if (!expectToken(",")) break;
+            }
+        }
+        
+        if (!expectToken("FROM")) return false;
+        
+        if (!parseTableRef(select.from)) return false;
+        
+        // [INNER] JOIN <table> [alias] ON <column> = <column>
+        while (isKeyword(getCurrentToken(), "JOIN") || isKeyword(getCurrentToken(), "INNER")) {
+            expectKeyword("INNER");
+            if (!expectKeyword("JOIN")) return false;
+            
+            JoinClause join;
+            if (!parseTableRef(join.table)) return false;
+            if (!expectKeyword("ON")) return false;
+            join.leftColumn = getCurrentToken();
+            consumeToken();
+            if (!expectToken("=")) return false;
+            join.rightColumn = getCurrentToken();
+            consumeToken();
+            if (join.leftColumn.empty() || join.rightColumn.empty()) return false;
+            select.joins.push_back(join);
+        }
+        
+        if (expectKeyword("WHERE")) {
+            conditionTables = {{select.from.alias, db.getTable(select.from.name)}};
+            for (const auto& join : select.joins) {
+                conditionTables.emplace_back(join.table.alias, db.getTable(join.table.name));
+            }
+            select.where = parseOr();
+            if (!select.where) return false;
+        }
+        
+        if (expectKeyword("GROUP")) {
+            if (!expectKeyword("BY")) return false;
+            while (true) {
+                std::string column = getCurrentToken();
+                if (!isIdentifier(column)) return false;
+                select.groupBy.push_back(column);
+                consumeToken();
+                
+                if (!expectToken(",")) break;
+            }
+        }
+        
+        if (expectKeyword("ORDER")) {
+            if (!expectKeyword("BY")) return false;
+            while (true) {
+                OrderItem order;
+                if (!parseSelectItem(order.item)) return false;
+                if (expectKeyword("DESC")) {
+                    order.descending = true;
+                } else {
+                    expectKeyword("ASC");
+                }
+                select.orderBy.push_back(order);
+                
+                if (!expectToken(",")) break;
+            }
+        }
+        
+        select.hasLimit = false;
+        if (expectKeyword("LIMIT")) {
+            if (!parseCount(select.limit)) return false;
+            select.hasLimit = true;
+        }
+        select.offset = 0;
+        if (expectKeyword("OFFSET")) {
+            if (!parseCount(select.offset)) return false;
+        }
+        
+        return true;
+    }
+
+    // CREATE MATERIALIZED VIEW <name> AS SELECT ...; definition receives the
+    // text of the SELECT, from which the view is created again when loaded
+    bool parseCreateMaterializedView(Database& db, std::string& viewName, SelectQuery& select,
+                                     std::string& definition) {
+        if (!expectToken("CREATE")) return false;
+        if (!expectToken("MATERIALIZED")) return false;
+        if (!expectToken("VIEW")) return false;
+        
+        viewName = getCurrentToken();
+        if (!isIdentifier(viewName)) return false;
+        consumeToken();
+        if (!expectKeyword("AS")) return false;
+        
+        size_t start = currentToken;
+        if (!parseSelect(db, select)) return false;
+        definition.clear();
+        for (size_t i = start; i < tokens.size() && tokens[i] != ";"; i++) {
+            if (!definition.empty()) definition += ' ';
+            definition += tokens[i];
+        }
+        return true;
+    }
+
+    // UPDATE <table> SET <column> = <value>[, ...] [WHERE <condition>]
+    bool parseUpdate(Database& db, std::string& tableName, std::vector<std::pair<std::string, Value>>& assignments,
+                     std::shared_ptr<Predicate>& where) {
+        if (!expectToken("UPDATE")) return false;
+        
+        tableName = getCurrentToken();
+        consumeToken();
+        
+        if (!expectKeyword("SET")) return false;
+        do {
+            std::string column = getCurrentToken();
+            if (!isIdentifier(column)) return false;
+            consumeToken();
+            if (!expectToken("=")) return false;
+            if (!isLiteral(getCurrentToken())) return false;
+            assignments.emplace_back(column, parseValue(getCurrentToken()));
+            consumeToken();
+        } while (expectToken(","));
+        
+        if (expectKeyword("WHERE")) {
+            conditionTables = {{tableName, db.getTable(tableName)}};
+            where = parseOr();
+            if (!where) return false;
+        }
+        return true;
+    }
+
+    bool parseDelete(Database& db, std::string& tableName, std::shared_ptr<Predicate>& where) {
+        if (!expectToken("DELETE")) return false;
+        if (!expectToken("FROM")) return false;
+        
+        tableName = getCurrentToken();
+        consumeToken();
+        
+        if (!expectKeyword("WHERE")) return false;
+        
+        conditionTables = {{tableName, db.getTable(tableName)}};
+        where = parseOr();
+        return where != nullptr;
+    }
+};
+
+// Read-only view of one result row. Values are referenced where the plan
+// left them, which for scans and index lookups is table storage, so reading
+// a row copies nothing. A view is valid until its cursor moves on.
+class RowView {
+private:
+    const Row* row;
+    const std::vector<size_t>* columnMap; // result column -> position in row; null if identical
+
+public:
+    RowView(const Row* r, const std::vector<size_t>* map) : row(r), columnMap(map) {}
+
+    size_t size() const {
+        return columnMap ? columnMap->size() : row->size();
+    }
+
+    const Value& operator[](size_t column) const {
+        return (*row)[columnMap ? (*columnMap)[column] : column];
+    }
+
+    // Typed accessors; they throw std::bad_variant_access if the value has
+    // a different type
+    int getInt(size_t column) const {
+        return std::get<int>((*this)[column].data);
+    }
+
+    double getReal(size_t column) const {
+        return std::get<double>((*this)[column].data);
+    }
+
+    bool getBool(size_t column) const {
+        return std::get<bool>((*this)[column].data);
+    }
+
+    const std::string& getText(size_t column) const {
+        return std::get<std::string>((*this)[column].data);
+    }
+};
+
+// Cursor over the result of a SELECT, pulling rows from the plan one at a
+// time. It holds shared locks on the tables the query reads so the rows it
+// points into stay put: INSERT and DELETE on those tables wait until the
+// cursor is exhausted, closed or destroyed. Tables must not be dropped while
+// a cursor reads them.
+class ResultCursor {
+private:
+    std::vector<std::shared_lock<std::shared_mutex>> guards;
+    std::unique_ptr<Operator> plan;
+    std::vector<size_t> projection; // empty if plan rows are the result rows
+    std::vector<Column> columns;
+    const Row* current = nullptr;
+    bool open = false;
+
+public:
+    ResultCursor(std::vector<std::shared_lock<std::shared_mutex>> locks, std::unique_ptr<Operator> p,
+                 const std::vector<size_t>& proj)
+        : guards(std::move(locks)), plan(std::move(p)), projection(proj) {
+        const auto& schema = plan->getSchema();
+        if (projection.empty()) {
+            columns = schema;
+        } else {
+            for (size_t column : projection) {
+                columns.push_back(schema[column]);
+            }
+        }
+        plan->open();
+        open = true;
+    }
+
+    ResultCursor(const ResultCursor&) = delete;
+    ResultCursor& operator=(const ResultCursor&) = delete;
+
+    ~ResultCursor() {
+        close();
+    }
+
+    const std::vector<Column>& getColumns() const {
+        return columns;
+    }
+
+    // Advances to the next row; false once the result is exhausted, at
+    // which point the cursor closes itself. Throws std::runtime_error if an
+    // operator cannot spill to disk.
+    bool next() {
+        if (!open) return false;
+        if (plan->next(current)) return true;
+        close();
         return false;
     }
 
-    DataType parseDataType(const std::string& typeStr) {
-        std::string upper = typeStr;
-        std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
-        
-        if (upper == "INTEGER" || upper == "INT") return DataType::INTEGER;
-        if (upper == "TEXT" || upper == "VARCHAR") return DataType::TEXT;
-        if (upper == "REAL" || upper == "DOUBLE") return DataType::REAL;
-        if (upper == "BOOLEAN" || upper == "BOOL") return DataType::BOOLEAN;
-        
-        return DataType::TEXT; // Default
-    }
+    RowView row() const {
+        return RowView(current, projection.empty() ? nullptr : &projection);
+    }
+
+    // Releases the plan's state and the table locks
+    void close() {
+        if (open) {
+            plan->close();
+            open = false;
+        }
+        current = nullptr;
+        guards.clear();
+    }
+};
+
+// Formats result lines into a bounded buffer that is written to the output
+// stream whenever it fills up, so memory use does not grow with the size of
+// a result and the first rows reach the output before the query finishes
+class ChunkedWriter {
+private:
+    std::ostream& out;
+    std::string buffer;
+    size_t chunkSize;
+    std::string* copy = nullptr;
+    size_t copyLimit = 0;
+
+public:
+    static constexpr size_t DEFAULT_CHUNK_SIZE = 64 * 1024;
+
+    ChunkedWriter(std::ostream& o, size_t chunk = DEFAULT_CHUNK_SIZE) : out(o), chunkSize(chunk) {
+        buffer.reserve(chunkSize + 256);
+    }
+
+    ~ChunkedWriter() {
+        flush();
+    }
+
+    // Also collects everything written in target, until it would grow past
+    // limit bytes; target is then cleared and no longer written
+    void keepCopy(std::string& target, size_t limit) {
+        copy = &target;
+        copyLimit = limit;
+    }
+
+    void append(char c) {
+        buffer.push_back(c);
+    }
+
+    void append(const std::string& text) {
+        buffer.append(text);
+    }
+
+    // Same text as Value::toString, without building a temporary string
+    void append(const Value& value) {
+        char digits[64];
+        switch (value.type) {
+            case DataType::INTEGER: {
+                auto end = std::to_chars(digits, digits + sizeof(digits), std::get<int>(value.data)).ptr;
+                buffer.append(digits, end);
+                break;
+            }
+            case DataType::REAL: {
+                int length = std::snprintf(digits, sizeof(digits), "%f", std::get<double>(value.data));
+                if (length >= 0 && static_cast<size_t>(length) < sizeof(digits)) {
+                    buffer.append(digits, length);
+                } else {
+                    buffer.append(value.toString());
+                }
+                break;
+            }
+            case DataType::BOOLEAN:
+                buffer.append(std::get<bool>(value.data) ? "true" : "false");
+                break;
+            case DataType::TEXT:
+                buffer.append(std::get<std::string>(value.data));
+                break;
+        }
+    }
+
+    void endLine() {
+        buffer.push_back('\n');
+        if (buffer.size() >= chunkSize) {
+            flush();
+        }
+    }
+
+    void flush() {
+        if (buffer.empty()) return;
+        if (copy && copy->size() + buffer.size() <= copyLimit) {
+            copy->append(buffer);
+        } else if (copy) {
+            std::string().swap(*copy);
+            copy = nullptr;
+        }
+        out.write(buffer.data(), buffer.size());
+        out.flush();
+        buffer.clear();
+    }
+};
+
+// Keeps the output of recent SELECTs, keyed by normalised query text, within
+// a byte budget; the least recently used results are evicted first. Each
+// result records the version of every table its query read and is returned
+// only while none of them has changed, so writers never have to find the
+// results they invalidate.
+class ResultCache {
+public:
+    using TableVersions = std::vector<std::pair<std::string, uint64_t>>;
+
+private:
+    struct Entry {
+        std::string key;
+        std::string result;
+        TableVersions versions;
+        size_t bytes;
+    };
+
+    std::list<Entry> entries; // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> entryMap;
+    size_t capacity = 0;
+    size_t usedBytes = 0;
+    mutable std::mutex mutex;
+
+    void erase(std::list<Entry>::iterator it) {
+        usedBytes -= it->bytes;
+        entryMap.erase(it->key);
+        entries.erase(it);
+    }
+
+    void evictTo(size_t bytes) {
+        while (usedBytes > bytes && !entries.empty()) {
+            erase(std::prev(entries.end()));
+        }
+    }
+
+public:
+    // A capacity of 0 disables the cache
+    void setCapacity(size_t bytes) {
+        std::lock_guard<std::mutex> guard(mutex);
+        capacity = bytes;
+        evictTo(capacity);
+    }
+
+    bool isEnabled() const {
+        std::lock_guard<std::mutex> guard(mutex);
+        return capacity > 0;
+    }
+
+    // Results larger than a quarter of the cache are not kept, so that one
+    // large result cannot evict everything else
+    size_t maxResultSize() const {
+        std::lock_guard<std::mutex> guard(mutex);
+        return capacity / 4;
+    }
+
+    // Finds the result cached for key; a result whose tables have changed or
+    // been dropped since it was produced is discarded instead
+    bool lookup(const std::string& key, Database& db, std::string& result) {
+        std::lock_guard<std::mutex> guard(mutex);
+        auto found = entryMap.find(key);
+        if (found == entryMap.end()) return false;
+
+        auto it = found->second;
+        for (const auto& [tableName, version] : it->versions) {
+            const Table* table = db.getTable(tableName);
+            if (!table || table->getVersion() != version) {
+                erase(it);
+                return false;
+            }
+        }
+        entries.splice(entries.begin(), entries, it);
+        result = it->result;
+        return true;
+    }
+
+    void insert(const std::string& key, std::string result, TableVersions versions) {
+        std::lock_guard<std::mutex> guard(mutex);
+        size_t bytes = sizeof(Entry) + 2 * key.size() + result.size();
+        for (const auto& version : versions) {
+            bytes += sizeof(version) + version.first.size();
+        }
+        if (bytes > capacity / 4) return;
+
+        auto found = entryMap.find(key);
+        if (found != entryMap.end()) erase(found->second);
+        evictTo(capacity - bytes);
+        entries.push_front(Entry{key, std::move(result), std::move(versions), bytes});
+        entryMap[key] = entries.begin();
+        usedBytes += bytes;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> guard(mutex);
+        entries.clear();
+        entryMap.clear();
+        usedBytes = 0;
+    }
+};
+
+// Database Engine
+class DatabaseEngine {
+private:
+    std::unique_ptr<Database> currentDb;
+    ExecutionContext settings;
+    ResultCache resultCache;
+
+    // Parses "<number>[KB|MB|GB]" into a byte count
+    static bool parseByteSize(const std::string& text, size_t& bytes) {
+        std::istringstream iss(text);
+        double amount;
+        std::string unit;
+        if (!(iss >> amount) || amount < 0) return false;
+        iss >> unit;
+        std::transform(unit.begin(), unit.end(), unit.begin(), ::toupper);
+
+        double multiplier = 1;
+        if (unit == "KB") multiplier = 1024.0;
+        else if (unit == "MB") multiplier = 1024.0 * 1024;
+        else if (unit == "GB") multiplier = 1024.0 * 1024 * 1024;
+        else if (!unit.empty() && unit != "B") return false;
+
+        bytes = static_cast<size_t>(amount * multiplier);
+        return true;
+    }
+
+    // SET <name> = <value>
+    std::string executeSet(const std::string& query) {
+        size_t eq = query.find('=');
+        if (eq == std::string::npos) {
+            return "Error: Invalid SET syntax";
+        }
 
-    Value parseValue(const std::string& valueStr) {
-        // Remove quotes if present
-        if ((valueStr.front() == '\'' && valueStr.back() == '\'') ||
-            (valueStr.front() == '"' && valueStr.back() == '"')) {
-            return Value(valueStr.substr(1, valueStr.length() - 2));
+        std::string name = query.substr(3, eq - 3);
+        std::string value = query.substr(eq + 1);
+        name.erase(0, name.find_first_not_of(" \t"));
+        name.erase(name.find_last_not_of(" \t;") + 1);
+        value.erase(0, value.find_first_not_of(" \t"));
+        value.erase(value.find_last_not_of(" \t;") + 1);
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+
+        if (name == "memory_limit") {
+            size_t bytes;
+            if (!parseByteSize(value, bytes) || bytes == 0) {
+                return "Error: Invalid value for memory_limit";
+            }
+            settings.memoryLimit = bytes;
+            return "memory_limit set to " + std::to_string(bytes) + " bytes";
         }
-        
-        // Try to parse as number
-        if (valueStr.find('.') != std::string::npos) {
+        if (name == "join_method") {
+            std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+            if (value == "auto") settings.joinMethod = JoinMethod::AUTO;
+            else if (value == "hash") settings.joinMethod = JoinMethod::HASH;
+            else if (value == "index_nested_loop") settings.joinMethod = JoinMethod::INDEX_NESTED_LOOP;
+            else if (value == "merge") settings.joinMethod = JoinMethod::MERGE;
+            else return "Error: join_method must be auto, hash, index_nested_loop or merge";
+            return "join_method set to " + value;
+        }
+        if (name == "parallelism") {
+            size_t threads = 0;
             try {
-                return Value(std::stod(valueStr));
-            } catch (...) {}
-        } else {
+                threads = std::stoul(value);
+            } catch (...) {
+            }
+            if (threads == 0) {
+                return "Error: parallelism must be a positive number of threads";
+            }
+            settings.parallelism = threads;
+            return "parallelism set to " + std::to_string(threads);
+        }
+        if (name == "worker_threads") {
+            size_t threads = 0;
             try {
-                return Value(std::stoi(valueStr));
-            } catch (...) {}
+                threads = std::stoul(value);
+            } catch (...) {
+            }
+            if (threads == 0) {
+                return "Error: worker_threads must be a positive number of threads";
+            }
+            ThreadPool& pool = ThreadPool::shared();
+            pool.configure(threads, pool.isPinned());
+            return "worker_threads set to " + std::to_string(threads);
         }
-        
-        // Parse as boolean
-        if (valueStr == "true" || valueStr == "TRUE") return Value(true);
-        if (valueStr == "false" || valueStr == "FALSE") return Value(false);
-        
-        return Value(valueStr);
+        if (name == "worker_pinning") {
+            std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+            if (value != "on" && value != "off") {
+                return "Error: worker_pinning must be on or off";
+            }
+            ThreadPool& pool = ThreadPool::shared();
+            pool.configure(pool.getWorkerCount(), value == "on");
+            return "worker_pinning set to " + value;
+        }
+        if (name == "result_cache_size") {
+            size_t bytes;
+            if (!parseByteSize(value, bytes)) {
+                return "Error: Invalid value for result_cache_size";
+            }
+            resultCache.setCapacity(bytes);
+            return "result_cache_size set to " + std::to_string(bytes) + " bytes";
+        }
+        return "Error: Unknown setting '" + name + "'";
     }
 
-public:
-    QueryParser(const std::string& sql) : query(sql), currentToken(0) {
-        tokenize();
-    }
+    // UPDATE: finds the matching rows (through an index where possible) and
+    // rewrites them in place. Rows keep their positions, so only the index
+    // entries of assigned columns whose value changes are touched.
+    std::string executeUpdate(const std::string& tableName, std::vector<std::pair<std::string, Value>> assignments,
+                              const std::shared_ptr<Predicate>& where) {
+        Table* table = currentDb->getTable(tableName);
+        if (!table) {
+            return "Error: Table '" + tableName + "' not found";
+        }
+        if (currentDb->isView(tableName)) {
+            return "Error: '" + tableName + "' is a materialized view";
+        }
 
-    bool parseCreateTable(Database& db, std::string& tableName, std::vector<Column>& columns) {
-        if (!expectToken("CREATE")) return false;
-        if (!expectToken("TABLE")) return false;
-        
-        tableName = getCurrentToken();
-        consumeToken();
-        
-        if (!expectToken("(")) return false;
-        
-        while (getCurrentToken() != ")" && currentToken < tokens.size()) {
-            std::string colName = getCurrentToken();
-            consumeToken();
-            
-            std::string typeStr = getCurrentToken();
-            consumeToken();
-            
-            Column col(colName, parseDataType(typeStr));
-            
-            // Check for constraints
-            while (getCurrentToken() != "," && getCurrentToken() != ")" && currentToken < tokens.size()) {
-                std::string constraint = getCurrentToken();
-                std::transform(constraint.begin(), constraint.end(), constraint.begin(), ::toupper);
-                
-                if (constraint == "PRIMARY") {
-                    consumeToken();
-                    if (expectToken("KEY")) {
-                        col.primaryKey = true;
-                    }
-                } else if (constraint == "NOT") {
-                    consumeToken();
-                    if (expectToken("NULL")) {
-                        col.notNull = true;
-                    }
-                } else if (constraint == "AUTO_INCREMENT" || constraint == "AUTOINCREMENT") {
-                    col.autoIncrement = true;
-                    consumeToken();
-                } else {
-                    consumeToken();
-                }
+        const auto& columns = table->getColumns();
+        std::vector<size_t> targets;
+        for (auto& [columnName, value] : assignments) {
+            int colIndex = table->getColumnIndex(columnName);
+            if (colIndex < 0) {
+                return "Error: Column '" + columnName + "' not found";
             }
-            
-            columns.push_back(col);
-            
-            if (getCurrentToken() == ",") {
-                consumeToken();
+            if (columns[colIndex].notNull && value.toString().empty()) {
+                return "Error: Column '" + columnName + "' cannot be empty";
             }
+            value = Table::toColumnType(std::move(value), columns[colIndex].type);
+            targets.push_back(colIndex);
         }
-        
-        return expectToken(")");
+        std::string error;
+        if (where && !QueryPlanner::bindPredicate(*where, columns, error)) {
+            return "Error: " + error;
+        }
+
+        auto guards = lockForWrite(tableName);
+        size_t updated = 0;
+        for (size_t position : QueryPlanner::findRows(*table, where)) {
+            const Row& row = table->getRow(position);
+            bool changed = false;
+            for (size_t i = 0; i < targets.size() && !changed; i++) {
+                changed = !(row[targets[i]] == assignments[i].second);
+            }
+            if (changed) {
+                std::vector<Value> values = row.values;
+                for (size_t i = 0; i < targets.size(); i++) {
+                    values[targets[i]] = assignments[i].second;
+                }
+                table->updateRow(position, std::move(values));
+            }
+            updated++;
+        }
+        return std::to_string(updated) + " rows updated";
     }
 
-    bool parseInsert(Database& db, std::string& tableName, std::vector<Value>& values) {
-        if (!expectToken("INSERT")) return false;
-        if (!expectToken("INTO")) return false;
-        
-        tableName = getCurrentToken();
-        consumeToken();
-        
-        if (!expectToken("VALUES")) return false;
-        if (!expectToken("(")) return false;
-        
-        while (getCurrentToken() != ")" && currentToken < tokens.size()) {
-            values.push_back(parseValue(getCurrentToken()));
-            consumeToken();
-            
-            if (getCurrentToken() == ",") {
-                consumeToken();
+    // ANALYZE [<table>]: collects statistics for one table or all of them,
+    // saves them and lists them one column per line
+    std::string executeAnalyze(const std::string& query) {
+        std::istringstream iss(query);
+        std::string keyword, tableName;
+        iss >> keyword >> tableName;
+        tableName.erase(tableName.find_last_not_of(";") + 1);
+
+        std::vector<std::string> names;
+        if (tableName.empty()) {
+            names = currentDb->listTables();
+            std::sort(names.begin(), names.end());
+        } else if (currentDb->getTable(tableName)) {
+            names.push_back(tableName);
+        } else {
+            return "Error: Table '" + tableName + "' not found";
+        }
+
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(4);
+        out << "table\tcolumn\trows\tdistinct\tnull_fraction\tmin\tmax\tmost_common\n";
+        for (const auto& name : names) {
+            const Table* table = currentDb->getTable(name);
+            std::shared_lock<std::shared_mutex> guard(table->getLock());
+            auto stats = table->analyze();
+            if (!currentDb->saveStatistics(name)) {
+                return "Error: Failed to save statistics for '" + name + "'";
+            }
+
+            for (size_t col = 0; col < stats->columns.size(); col++) {
+                const ColumnStatistics& column = stats->columns[col];
+                out << name << '\t' << table->getColumns()[col].name << '\t' << stats->rowCount << '\t'
+                    << static_cast<size_t>(std::llround(column.distinctCount)) << '\t' << stats->nullFraction(col)
+                    << '\t' << (column.hasRange ? column.min.toString() : "") << '\t'
+                    << (column.hasRange ? column.max.toString() : "") << '\t';
+                for (size_t i = 0; i < column.mostCommon.size(); i++) {
+                    out << (i > 0 ? ", " : "") << column.mostCommon[i].first.toString() << " ("
+                        << column.mostCommon[i].second << ")";
+                }
+                out << '\n';
             }
         }
-        
-        return expectToken(")");
+        out << "\n" << names.size() << " tables analyzed";
+        return out.str();
     }
 
-    bool parseSelect(Database& db, std::string& tableName, std::string& whereColumn, Value& whereValue, bool& hasWhere) {
-        if (!expectToken("SELECT")) return false;
-        
-        // Skip column list for now (assume SELECT *)
-        while (getCurrentToken() != "FROM" && currentToken < tokens.size()) {
-            consumeToken();
+    // Writes a header line and one tab-separated line per row; returns the
+    // number of rows. If copy is given, the text is also collected there
+    // unless it exceeds copyLimit bytes, in which case copy is left empty.
+    static size_t writeResults(ResultCursor& cursor, std::ostream& out,
+                               std::string* copy = nullptr, size_t copyLimit = 0) {
+        ChunkedWriter writer(out);
+        if (copy) writer.keepCopy(*copy, copyLimit);
+        const auto& columns = cursor.getColumns();
+        for (size_t i = 0; i < columns.size(); i++) {
+            if (i > 0) writer.append('\t');
+            writer.append(columns[i].name);
         }
-        
-        if (!expectToken("FROM")) return false;
-        
-        tableName = getCurrentToken();
-        consumeToken();
-        
-        hasWhere = false;
-        if (getCurrentToken() == "WHERE") {
-            consumeToken();
-            whereColumn = getCurrentToken();
-            consumeToken();
-            
-            if (expectToken("=")) {
-                whereValue = parseValue(getCurrentToken());
-                consumeToken();
-                hasWhere = true;
+        writer.endLine();
+
+        size_t rowCount = 0;
+        while (cursor.next()) {
+            RowView row = cursor.row();
+            for (size_t i = 0; i < row.size(); i++) {
+                if (i > 0) writer.append('\t');
+                writer.append(row[i]);
             }
+            writer.endLine();
+            rowCount++;
         }
-        
-        return true;
+        return rowCount;
     }
 
-    bool parseDelete(Database& db, std::string& tableName, std::string& whereColumn, Value& whereValue) {
-        if (!expectToken("DELETE")) return false;
-        if (!expectToken("FROM")) return false;
-        
-        tableName = getCurrentToken();
-        consumeToken();
-        
-        if (!expectToken("WHERE")) return false;
-        
-        whereColumn = getCurrentToken();
-        consumeToken();
-        
-        if (!expectToken("=")) return false;
-        
-        whereValue = parseValue(getCurrentToken());
-        consumeToken();
-        
-        return true;
+    // Shared locks on the tables a query reads, taken in address order
+    // (std::less, which orders unrelated pointers totally) so that readers
+    // of the same tables never wait on each other in a cycle
+    std::vector<std::shared_lock<std::shared_mutex>> lockTables(const SelectQuery& select) const {
+        std::vector<const Table*> tables;
+        std::vector<TableRef> refs = {select.from};
+        for (const auto& join : select.joins) {
+            refs.push_back(join.table);
+        }
+        for (const auto& ref : refs) {
+            const Table* table = currentDb->getTable(ref.name);
+            if (table) tables.push_back(table);
+        }
+        std::sort(tables.begin(), tables.end(), std::less<const Table*>());
+        tables.erase(std::unique(tables.begin(), tables.end()), tables.end());
+
+        std::vector<std::shared_lock<std::shared_mutex>> guards;
+        for (const Table* table : tables) {
+            guards.emplace_back(table->getLock());
+        }
+        return guards;
     }
-};
 
-// Database Engine
-class DatabaseEngine {
-private:
-    std::unique_ptr<Database> currentDb;
+    // Exclusive locks for a statement that modifies a table: on the table
+    // and on the views maintained from it, whose rows change with it. They
+    // are taken in address order, like the shared locks of lockTables.
+    std::vector<std::unique_lock<std::shared_mutex>> lockForWrite(const std::string& tableName) {
+        std::vector<Table*> tables = {currentDb->getTable(tableName)};
+        for (const auto& viewName : currentDb->getViews(tableName)) {
+            tables.push_back(currentDb->getTable(viewName));
+        }
+        std::sort(tables.begin(), tables.end(), std::less<Table*>());
+
+        std::vector<std::unique_lock<std::shared_mutex>> guards;
+        for (Table* table : tables) {
+            guards.emplace_back(table->getLock());
+        }
+        return guards;
+    }
+
+    // Creates a materialized view from its parsed definition, reading the
+    // source table under an exclusive lock so no change is missed
+    std::string createView(const std::string& viewName, const SelectQuery& select, const std::string& definition) {
+        Table* source = currentDb->getTable(select.from.name);
+        std::unique_lock<std::shared_mutex> guard;
+        if (source) guard = std::unique_lock<std::shared_mutex>(source->getLock());
+
+        std::string error;
+        if (!MaterializedView::create(*currentDb, viewName, select, definition, error)) {
+            return "Error: " + error;
+        }
+        return "Materialized view '" + viewName + "' created successfully";
+    }
+
+    std::unique_ptr<ResultCursor> openCursor(const SelectQuery& select, std::string& error) {
+        auto guards = lockTables(select);
+        std::vector<size_t> projection;
+        auto plan = QueryPlanner::planSelect(*currentDb, select, queryContext(), error, &projection);
+        if (!plan) return nullptr;
+        try {
+            return std::make_unique<ResultCursor>(std::move(guards), std::move(plan), projection);
+        } catch (const std::exception& e) {
+            error = e.what();
+            return nullptr;
+        }
+    }
+
+    // Writes one line per operator, inputs indented below it, and collects
+    // the indexes the plan reads through
+    static void explainOperator(Operator& op, size_t depth, std::ostream& out, std::vector<std::string>& indexes) {
+        out << std::string(depth * 2, ' ') << (depth > 0 ? "-> " : "") << op.describe();
+        if (op.estimatedRows >= 0) {
+            out << "  (estimated rows=" << static_cast<size_t>(std::llround(op.estimatedRows)) << ")";
+        }
+        if (const auto* profiled = dynamic_cast<const ProfilingOperator*>(&op)) {
+            out << "  (actual rows=" << profiled->getRows() << " bytes=" << profiled->getBytes()
+                << " time=" << profiled->getMilliseconds() << " ms)";
+        }
+        out << "\n";
+
+        std::string index = op.indexUsed();
+        if (!index.empty() && std::find(indexes.begin(), indexes.end(), index) == indexes.end()) {
+            indexes.push_back(index);
+        }
+        for (auto* input : op.inputs()) {
+            explainOperator(**input, depth + 1, out, indexes);
+        }
+    }
+
+    // EXPLAIN [ANALYZE] SELECT ...: prints the plan; with ANALYZE the query
+    // runs first (its rows are discarded) and each operator reports the
+    // rows and bytes it produced and the time spent in it and its inputs
+    void executeExplain(const std::string& query, std::ostream& out) {
+        std::istringstream iss(query);
+        std::string keyword;
+        iss >> keyword;
+        std::streampos start = iss.tellg();
+        iss >> keyword;
+        std::transform(keyword.begin(), keyword.end(), keyword.begin(), ::toupper);
+        bool analyze = keyword == "ANALYZE";
+        if (!analyze) iss.seekg(start);
+        std::string select((std::istreambuf_iterator<char>(iss)), std::istreambuf_iterator<char>());
+
+        QueryParser parser(select);
+        SelectQuery parsed;
+        if (!parser.parseSelect(*currentDb, parsed)) {
+            out << "Error: EXPLAIN requires a valid SELECT";
+            return;
+        }
+
+        auto guards = lockTables(parsed);
+        std::string error;
+        auto plan = QueryPlanner::planSelect(*currentDb, parsed, queryContext(), error);
+        if (!plan) {
+            out << "Error: " << error;
+            return;
+        }
+
+        double totalMilliseconds = 0;
+        size_t rowCount = 0;
+        if (analyze) {
+            plan = profilePlan(std::move(plan));
+            auto begin = std::chrono::steady_clock::now();
+            const Row* row;
+            plan->open();
+            while (plan->next(row)) rowCount++;
+            plan->close();
+            totalMilliseconds =
+                std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+        }
+
+        std::vector<std::string> indexes;
+        out << std::fixed << std::setprecision(3);
+        explainOperator(*plan, 0, out, indexes);
+        out << "Indexes used: ";
+        for (size_t i = 0; i < indexes.size(); i++) {
+            out << (i > 0 ? ", " : "") << indexes[i];
+        }
+        out << (indexes.empty() ? "none" : "");
+        if (analyze) {
+            out << "\nExecution time: " << totalMilliseconds << " ms, " << rowCount << " rows";
+        }
+        out << std::defaultfloat;
+    }
+
+    // Versions of the tables a query reads. Taken while the query's cursor
+    // holds its shared locks, they are the versions its result reflects.
+    ResultCache::TableVersions tableVersions(const SelectQuery& select) const {
+        ResultCache::TableVersions versions;
+        std::vector<TableRef> refs = {select.from};
+        for (const auto& join : select.joins) {
+            refs.push_back(join.table);
+        }
+        for (const auto& ref : refs) {
+            const Table* table = currentDb->getTable(ref.name);
+            if (table) versions.emplace_back(ref.name, table->getVersion());
+        }
+        return versions;
+    }
+
+    ExecutionContext queryContext() const {
+        ExecutionContext context = settings;
+        context.tempDir = currentDb->getDataDir() + "/tmp";
+        return context;
+    }
 
 public:
     bool createDatabase(const std::string& dbName) {
         currentDb = std::make_unique<Database>(dbName);
+        resultCache.clear();
         return true;
     }
 
     bool openDatabase(const std::string& dbName) {
         currentDb = std::make_unique<Database>(dbName);
-        return currentDb->loadFromFile();
+        resultCache.clear();
+        if (!currentDb->loadFromFile()) return false;
+
+        // Views are saved as their definitions and computed again
+        for (const auto& [viewName, definition] : currentDb->takeSavedViews()) {
+            QueryParser parser(definition);
+            SelectQuery select;
+            if (parser.parseSelect(*currentDb, select)) {
+                createView(viewName, select, definition);
+            }
+        }
+        return true;
     }
 
     bool saveDatabase() {
         return currentDb ? currentDb->saveToFile() : false;
     }
 
+    // Opens a cursor over the result of a SELECT for reading rows in place;
+    // returns nullptr and sets error if the query is invalid
+    std::unique_ptr<ResultCursor> openCursor(const std::string& query, std::string& error) {
+        if (!currentDb) {
+            error = "No database selected";
+            return nullptr;
+        }
+        QueryParser parser(query);
+        SelectQuery select;
+        if (!parser.parseSelect(*currentDb, select)) {
+            error = "Invalid SELECT syntax";
+            return nullptr;
+        }
+        return openCursor(select, error);
+    }
+
     std::string executeQuery(const std::string& query) {
+        std::stringstream result;
+        executeQuery(query, result);
+        return result.str();
+    }
+
+    // Executes a query and writes its result to out. SELECT results are
+    // written in chunks as rows are produced rather than collected first.
+    // A query that fails while running, for instance because a spill file
+    // cannot be created, ends with an error; unwinding destroys its plan,
+    // which removes the plan's spill files.
+    void executeQuery(const std::string& query, std::ostream& result) {
+        try {
+            runQuery(query, result);
+        } catch (const std::exception& e) {
+            result << "Error: " << e.what();
+        }
+    }
+
+private:
+    void runQuery(const std::string& query, std::ostream& result) {
         if (!currentDb) {
-            return "Error: No database selected";
+            result << "Error: No database selected";
+            return;
         }
 
         QueryParser parser(query);
-        std::stringstream result;
 
         // Determine query type
         std::string queryUpper = query;
@@ -726,13 +6974,27 @@ public:
                 result << "Error: Invalid CREATE TABLE syntax";
             }
         }
+        else if (queryUpper.find("CREATE MATERIALIZED VIEW") == 0) {
+            std::string viewName;
+            SelectQuery select;
+            std::string definition;
+            
+            if (parser.parseCreateMaterializedView(*currentDb, viewName, select, definition)) {
+                result << createView(viewName, select, definition);
+            } else {
+                result << "Error: Invalid CREATE MATERIALIZED VIEW syntax";
+            }
+        }
         else if (queryUpper.find("INSERT INTO") == 0) {
             std::string tableName;
             std::vector<Value> values;
             
             if (parser.parseInsert(*currentDb, tableName, values)) {
                 Table* table = currentDb->getTable(tableName);
-                if (table) {
+                if (table && currentDb->isView(tableName)) {
+                    result << "Error: '" << tableName << "' is a materialized view";
+                } else if (table) {
+                    auto guards = lockForWrite(tableName);
                     if (table->insertRow(values)) {
                         result << "Row inserted successfully";
                     } else {
@@ -746,67 +7008,81 @@ public:
             }
         }
         else if (queryUpper.find("SELECT") == 0) {
-            std::string tableName, whereColumn;
-            Value whereValue("");
-            bool hasWhere;
+            SelectQuery select;
+            std::string cacheKey = resultCache.isEnabled() ? QueryParser::normalize(query) : "";
+            std::string cached;
             
-            if (parser.parseSelect(*currentDb, tableName, whereColumn, whereValue, hasWhere)) {
-                Table* table = currentDb->getTable(tableName);
-                if (table) {
-                    std::vector<Row> rows;
-                    
-                    if (hasWhere) {
-                        rows = table->selectWhere(whereColumn, whereValue);
-                    } else {
-                        rows = table->selectAll();
-                    }
-                    
-                    // Format output
-                    const auto& columns = table->getColumns();
-                    
-                    // Headers
-                    for (size_t i = 0; i < columns.size(); i++) {
-                        if (i > 0) result << "\t";
-                        result << columns[i].name;
-                    }
-                    result << "\n";
-                    
-                    // Data
-                    for (const auto& row : rows) {
-                        for (size_t i = 0; i < row.size(); i++) {
-                            if (i > 0) result << "\t";
-                            result << row[i].toString();
-                        }
-                        result << "\n";
-                    }
-                    
-                    result << "\n" << rows.size() << " rows returned";
+            if (!cacheKey.empty() && resultCache.lookup(cacheKey, *currentDb, cached)) {
+                result << cached;
+            } else if (parser.parseSelect(*currentDb, select)) {
+                std::string error;
+                auto cursor = openCursor(select, error);
+                if (!cursor) {
+                    result << "Error: " << error;
+                } else if (cacheKey.empty()) {
+                    size_t rowCount = writeResults(*cursor, result);
+                    result << "\n" << rowCount << " rows returned";
                 } else {
-                    result << "Error: Table '" << tableName << "' not found";
+                    auto versions = tableVersions(select);
+                    std::string copy;
+                    size_t rowCount = writeResults(*cursor, result, &copy, resultCache.maxResultSize());
+                    std::string summary = "\n" + std::to_string(rowCount) + " rows returned";
+                    result << summary;
+                    if (!copy.empty()) {
+                        resultCache.insert(cacheKey, copy + summary, std::move(versions));
+                    }
                 }
             } else {
                 result << "Error: Invalid SELECT syntax";
             }
         }
+        else if (queryUpper.find("UPDATE") == 0) {
+            std::string tableName;
+            std::vector<std::pair<std::string, Value>> assignments;
+            std::shared_ptr<Predicate> where;
+            
+            if (parser.parseUpdate(*currentDb, tableName, assignments, where)) {
+                result << executeUpdate(tableName, std::move(assignments), where);
+            } else {
+                result << "Error: Invalid UPDATE syntax";
+            }
+        }
         else if (queryUpper.find("DELETE FROM") == 0) {
-            std::string tableName, whereColumn;
-            Value whereValue("");
+            std::string tableName;
+            std::shared_ptr<Predicate> where;
             
-            if (parser.parseDelete(*currentDb, tableName, whereColumn, whereValue)) {
+            if (parser.parseDelete(*currentDb, tableName, where)) {
                 Table* table = currentDb->getTable(tableName);
-                if (table) {
-                    if (table->deleteWhere(whereColumn, whereValue)) {
+                std::string error;
+                if (!table) {
+                    result << "Error: Table '" << tableName << "' not found";
+                } else if (currentDb->isView(tableName)) {
+                    result << "Error: '" << tableName << "' is a materialized view";
+                } else if (!QueryPlanner::bindPredicate(*where, table->getColumns(), error)) {
+                    result << "Error: " << error;
+                } else {
+                    auto guards = lockForWrite(tableName);
+                    std::vector<size_t> positions = QueryPlanner::findRows(*table, where);
+                    table->deleteRows(positions);
+                    if (!positions.empty()) {
                         result << "Rows deleted successfully";
                     } else {
                         result << "No rows matched the condition";
                     }
-                } else {
-                    result << "Error: Table '" << tableName << "' not found";
                 }
             } else {
                 result << "Error: Invalid DELETE syntax";
             }
         }
+        else if (queryUpper.find("EXPLAIN") == 0) {
+            executeExplain(query, result);
+        }
+        else if (queryUpper.find("ANALYZE") == 0) {
+            result << executeAnalyze(query);
+        }
+        else if (queryUpper.find("SET ") == 0) {
+            result << executeSet(query);
+        }
         else if (queryUpper.find("SHOW TABLES") == 0) {
             auto tables = currentDb->listTables();
             result << "Tables:\n";
@@ -817,10 +7093,9 @@ public:
         else {
             result << "Error: Unsupported query type";
         }
-
-        return result.str();
     }
 
+public:
     void showHelp() {
         std::cout << "\n=== Simple Database Engine Help ===\n";
         std::cout << "Commands:\n";
@@ -832,9 +7107,27 @@ public:
         std::cout << "SQL Commands:\n";
         std::cout << "  CREATE TABLE <name> (<columns>)\n";
         std::cout << "  INSERT INTO <table> VALUES (<values>)\n";
-        std::cout << "  SELECT * FROM <table> [WHERE <column> = <value>]\n";
-        std::cout << "  DELETE FROM <table> WHERE <column> = <value>\n";
-        std::cout << "  SHOW TABLES\n\n";
+        std::cout << "  SELECT <*|columns> FROM <table> [JOIN <table> ON <column> = <column> ...]\n";
+        std::cout << "         [WHERE <condition>] [GROUP BY <columns>]\n";
+        std::cout << "         [ORDER BY <column> [ASC|DESC], ...] [LIMIT <n>] [OFFSET <n>]\n";
+        std::cout << "    columns may be aggregates: COUNT(*), COUNT|SUM|AVG|MIN|MAX(<column>)\n";
+        std::cout << "  UPDATE <table> SET <column> = <value>, ... [WHERE <condition>]\n";
+        std::cout << "  DELETE FROM <table> WHERE <condition>\n";
+        std::cout << "    conditions: <column> <op> <value> with =, <>, <, <=, >, >=\n";
+        std::cout << "                combined with AND, OR, NOT and parentheses\n";
+        std::cout << "  EXPLAIN [ANALYZE] SELECT ...            - Show the plan; ANALYZE runs it and adds\n";
+        std::cout << "                                         per-operator rows, bytes and time\n";
+        std::cout << "  CREATE MATERIALIZED VIEW <name> AS SELECT ... GROUP BY ...\n";
+        std::cout << "                                       - Aggregates kept up to date as rows change\n";
+        std::cout << "  SHOW TABLES\n";
+        std::cout << "  ANALYZE [<table>]                    - Collect and save planner statistics\n";
+        std::cout << "  SET memory_limit = <bytes>[KB|MB|GB]  - Memory per operator before spilling\n";
+        std::cout << "  SET join_method = auto|hash|index_nested_loop|merge\n";
+        std::cout << "  SET parallelism = <threads>          - Tasks a parallel operator runs at once\n";
+        std::cout << "  SET worker_threads = <threads>       - Size of the shared worker pool\n";
+        std::cout << "  SET worker_pinning = on|off          - Pin pool workers to CPU cores\n";
+        std::cout << "  SET result_cache_size = <bytes>[KB|MB|GB]\n";
+        std::cout << "                                       - Memory for cached SELECT results (0 = off)\n\n";
         std::cout << "Example:\n";
         std::cout << "  CREATE TABLE users (id INTEGER PRIMARY KEY, name TEXT NOT NULL)\n";
         std::cout << "  INSERT INTO users VALUES (1, 'John Doe')\n";
@@ -853,7 +7146,7 @@ int main() {
 
     while (true) {
         std::cout << "db> ";
-        std::getline(std::cin, input);
+        if (!std::getline(std::cin, input)) break;
 
         if (input.empty()) continue;
 
@@ -905,9 +7198,9 @@ int main() {
             }
         }
         else {
-            // Execute SQL query
-            std::string result = engine.executeQuery(input);
-            std::cout << result << "\n";
+            // Execute SQL query; results are written as they are produced
+            engine.executeQuery(input, std::cout);
+            std::cout << "\n";
         }
         
         std::cout << "\n";